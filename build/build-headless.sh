@@ -0,0 +1 @@
+g++ headless.cpp -o headless -lpthread -std=c++20 -O2
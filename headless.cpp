@@ -0,0 +1,795 @@
+// Runs the world simulation without a window and prints how long the ticks took
+// Usage: ./headless [seed] [ticks] [threads] [save folder or -] [page budget in KB]
+// With a save folder every chunk is stored and the world is saved, loaded back and checked against the original
+// With a page budget every chunk is stored, the focus is swept over the world and the paged world is checked against the original
+// Exits with 1 if any of the checks fail
+
+#define HEADLESS
+
+// C++ headers
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <sstream>
+#include <stdlib.h>
+
+#include <sys/resource.h>
+
+// Local headers
+#include "src/tiles.cpp"
+#include "src/world.cpp"
+
+#include "src/random.h"
+#include "src/collision.h"
+
+using namespace std;
+
+#define RENDER_CHECK_RADIUS 3 // Chunks either side of the middle read while each tick runs
+#define EDIT_CHECK_TICKS 50
+#define QUEUE_CHECK_ITEMS 200000 // Items passed from one thread to another through the command queue
+#define COLLISION_CHECK_BODIES 2000
+#define COLLISION_CHECK_STEPS 600
+#define QUERY_BOX 128 // Width in tiles of the box around the middle the query benchmarks use
+#define QUERY_RAYS 20000
+#define QUERY_ROUNDS 20
+#define CARVE_CHECK_CAVES 400 // Caves carved around the middle of two copies of the world
+#define SCALING_BAND 4 // Rows of chunks filled with gas across the whole world for the thread sweep
+#define SCALING_TICKS 100
+#define KERNEL_CHECK_HALOS 4096 // Random chunk halos every gas kernel is run on
+#define KERNEL_ROUNDS 100
+#define LOOKUP_COUNT 4000000 // Random tiles and chunks looked up through the map and through the grid
+#define ADJACENCY_CHECK_TICKS 200
+#define ADJACENCY_CHECK_EDITS 100 // Random tiles posted around the middle during each tick of the adjacency check
+
+world_map World;
+
+// Set by any check that fails, main returns non-zero if it is
+bool failed = false;
+
+// A line's name padded out to where the values start
+string padded(const string &name) {
+    return name + ":" + string(std::max(15 - (int)name.size(), 1), ' ');
+}
+// Prints a check's line, what was measured and then ok or what went wrong
+void report(const string &name, bool ok, const string &detail = "", const char * wrong = "MISMATCH") {
+    failed |= !ok;
+    cout << padded(name) << detail << (detail.empty() ? "" : ", ") << (ok ? "ok" : wrong) << "\n";
+}
+
+// Peak resident memory of the process in bytes
+long peak_memory() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss;
+#else
+    return usage.ru_maxrss * 1024;
+#endif
+}
+
+// Hash of every stored tile, for checking that two runs made the same world
+unsigned long long world_hash(world_map &World) {
+    unsigned long long h = 0;
+    World.chunks.for_each([&](UShortVec2 pos, chunk * c) {
+        unsigned long long ch = Random::mix(pos.x * 65536ULL + pos.y);
+        for(int x = 0;x<16;++x) {
+            for(int y = 0;y<16;++y) {
+                tiles::packed_tile t = c->packed(x, y);
+                ch = Random::mix(ch ^ (t.id * 65536ULL + t.mass));
+            }
+        }
+        h += ch;
+    });
+    return h;
+}
+
+// Every chunk's tiles, reading back anything that is not in memory
+vector<tile_planes> all_planes() {
+    vector<tile_planes> planes(CHUNK_COUNT * CHUNK_COUNT);
+    for(unsigned short y = 0;y<CHUNK_COUNT;++y)
+        for(unsigned short x = 0;x<CHUNK_COUNT;++x)
+            if(chunk * c = World.chunks.find({x, y}))
+                c->store.copy_to(planes[y*CHUNK_COUNT + x]);
+    return planes;
+}
+
+// How many chunks are in each form and how much smaller that makes them than keeping every tile
+void memory_report(const char * label, world_map &World) {
+    size_t forms[3] = {};
+    size_t uniform_masks = 0;
+    World.chunks.for_each([&](UShortVec2, chunk * c) {
+        ++forms[c->store.get_form()];
+        uniform_masks += !c->adjacency.heap_bytes();
+    });
+    cout << label << World.chunks.size() << " chunks, " << forms[tile_store::UNIFORM] << " uniform, " << forms[tile_store::PALETTE] << " palette, "
+         << forms[tile_store::FULL] << " full, " << uniform_masks << " with uniform masks, " << pretty_size(World.chunks.memory())
+         << " (" << pretty_size(World.chunks.memory_bound()) << " unpacked)\n";
+}
+
+void store_everything() {
+    for(unsigned short y = 0;y<CHUNK_COUNT;++y)
+        for(unsigned short x = 0;x<CHUNK_COUNT;++x)
+            if(!World.chunks.find({x, y}))
+                World.create_chunk({x, y});
+}
+
+// Reads the chunks around the middle of the world the way the renderer does, to run alongside the workers
+unsigned long long read_like_renderer(world_map &World) {
+    unsigned long long sum = 0;
+    UShortVec2 middle = {WORLD_SIZE/32, WORLD_SIZE/32};
+    for(unsigned short y = middle.y - RENDER_CHECK_RADIUS;y<=middle.y + RENDER_CHECK_RADIUS;++y) {
+        for(unsigned short x = middle.x - RENDER_CHECK_RADIUS;x<=middle.x + RENDER_CHECK_RADIUS;++x) {
+            chunk * c = World.get_chunk({x, y});
+            for(unsigned short ty = 0;ty<16;++ty)
+                for(unsigned short tx = 0;tx<16;++tx)
+                    sum += World.get_tile_c({tx, ty}, c).id;
+        }
+    }
+    return sum;
+}
+
+// Same world setup as the game
+void build_world(world_map &w) {
+    const Structure &start_zone = LoadStructure("resources/structures/start_zone.struct");
+    vector<stamp> start_caves;
+    w.cave_stamps({(WORLD_SIZE/2), (WORLD_SIZE/2) - 3}, 10, 9, {tiles::ID::OXYGEN, 1400}, start_caves);
+    w.cave_stamps((IntVec2){(WORLD_SIZE/2), (WORLD_SIZE/2) - 6}, 3, 3, {tiles::ID::SILT, 1200}, start_caves);
+    w.generate(nullptr, {{&start_zone, {(WORLD_SIZE/2)-(start_zone.width/2), WORLD_SIZE/2-(start_zone.height/2)}}}, start_caves);
+    w.log = false;
+}
+
+bool is_solid(IntVec2 pos) {
+    return tiles::is_collidable(World.get_tile(pos).id);
+}
+bool overlaps_solid(const body &b) {
+    for(int x = floor(b.position.x - b.half_size.x);x<=floor(b.position.x + b.half_size.x);++x)
+        for(int y = floor(b.position.y - b.half_size.y);y<=floor(b.position.y + b.half_size.y);++y)
+            if(is_solid({x, y}))
+                return true;
+    return false;
+}
+
+double ms_since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// Edits made while a tick runs are seen by the main thread straight away and are what the tiles hold once it is swapped in
+void edit_check() {
+    int wrong_edits = 0;
+    for(int i = 0;i<EDIT_CHECK_TICKS;++i) {
+        World.tick_update(nullptr);
+        vector<pair<IntVec2, tiles::tile>> made;
+        for(int e = 0;e<8;++e) {
+            IntVec2 pos = {WORLD_SIZE/2 - 8 + e*2, WORLD_SIZE/2 - 4 + i%8};
+            tiles::tile t = e%2 ? (tiles::tile){tiles::ID::OXYGEN, (float)(100 + i*10 + e)} : tiles::from_id(tiles::ID::INSULATION);
+            World.post({world_command::SET_TILE, pos, t});
+            // A later mass change lands on top of the tile posted before it
+            if(e == 3) {
+                t.mass = 50;
+                World.post({world_command::SET_MASS, pos, {tiles::ID::VOID, t.mass}});
+            }
+            made.push_back({pos, t});
+        }
+        // Ones off the edges of the world are dropped
+        World.post({world_command::SET_TILE, {-1, WORLD_SIZE/2}, tiles::from_id(tiles::ID::INSULATION)});
+        World.post({world_command::SET_TILE, {WORLD_SIZE/2, WORLD_SIZE}, tiles::from_id(tiles::ID::INSULATION)});
+        for(auto &edit : made)
+            wrong_edits += World.get_tile(edit.first).id != edit.second.id;
+        read_like_renderer(World);
+        World.finish_tick();
+        for(auto &edit : made) {
+            tiles::tile t = World.get_tile(edit.first);
+            wrong_edits += t.id != edit.second.id || tiles::pack_mass(t.mass) != tiles::pack_mass(edit.second.mass);
+        }
+    }
+    report("Edits in ticks", !wrong_edits);
+}
+
+// The command queue between two threads keeps everything in order
+void queue_check() {
+    spsc_queue<unsigned int, 64> queue;
+    thread producer([&queue]() {
+        for(unsigned int i = 0;i<QUEUE_CHECK_ITEMS;) {
+            if(queue.push(i))
+                ++i;
+            else
+                this_thread::yield();
+        }
+    });
+    unsigned int expected = 0;
+    bool in_order = true;
+    while(expected < QUEUE_CHECK_ITEMS) {
+        unsigned int item;
+        if(queue.pop(item))
+            in_order &= item == expected++;
+        else
+            this_thread::yield();
+    }
+    producer.join();
+    report("Command queue", in_order && queue.empty());
+}
+
+// Bodies thrown around the middle of the world fast enough to cross several tiles a step never end up in a wall,
+// even with walls being put down around them as they go
+void collision_check() {
+    collision_system collisions;
+    vector<body> bodies;
+    for(int i = 0;bodies.size()<COLLISION_CHECK_BODIES && i<COLLISION_CHECK_BODIES*20;++i) {
+        body b;
+        b.position = {WORLD_SIZE/2 - 30 + Random::Rand(i*4)*60, WORLD_SIZE/2 - 30 + Random::Rand(i*4 + 1)*60};
+        float angle = Random::Rand(i*4 + 2) * 2 * PI;
+        float speed = Random::Rand(i*4 + 3) * 300;
+        b.velocity = {cos(angle) * speed, sin(angle) * speed};
+        if(!overlaps_solid(b))
+            bodies.push_back(b);
+    }
+    for(body &b : bodies)
+        collisions.add(&b);
+    // Bodies a wall is put down on are taken out
+    vector<char> removed(bodies.size());
+
+    int inside = 0;
+    auto start = chrono::steady_clock::now();
+    for(int i = 0;i<COLLISION_CHECK_STEPS;++i) {
+        if(i % 20 == 0) {
+            IntVec2 pos = {WORLD_SIZE/2 - 20 + (int)(Random::Rand(i + 1000000)*40), WORLD_SIZE/2 - 20 + (int)(Random::Rand(i + 2000000)*40)};
+            World.set_tile({(unsigned short)(pos.x%16), (unsigned short)(pos.y%16)}, {(unsigned short)(pos.x/16), (unsigned short)(pos.y/16)}, tiles::from_id(tiles::ID::INSULATION));
+            for(size_t b = 0;b<bodies.size();++b) {
+                if(!removed[b] && overlaps_solid(bodies[b])) {
+                    collisions.remove(&bodies[b]);
+                    removed[b] = 1;
+                }
+            }
+        }
+        collisions.changed(World.solid_changes, World.last_solid_change);
+        collisions.step(1.0f / COLLISION_STEP_RATE, is_solid);
+        // Ones that hit something bounce off in a new direction
+        for(body &b : bodies) {
+            if(b.collision)
+                b.velocity = {-b.velocity.y, b.velocity.x};
+        }
+        for(size_t b = 0;b<bodies.size();b+=97)
+            inside += !removed[b] && overlaps_solid(bodies[b]);
+    }
+    double collision_ms = ms_since(start);
+    for(size_t b = 0;b<bodies.size();++b)
+        inside += !removed[b] && overlaps_solid(bodies[b]);
+    ostringstream detail;
+    detail << bodies.size() << " bodies, " << COLLISION_CHECK_STEPS << " steps in " << collision_ms << " ms, "
+           << collisions.refreshes << " window refreshes reading " << collisions.tiles_read << " tiles";
+    report("Collision", !inside, detail.str(), "IN A WALL");
+}
+
+// Times each of the world's batched queries against doing the same a tile at a time through get_tile and set_tile,
+// and checks both ways come out the same
+void query_benchmarks() {
+    cout << padded("Queries") << QUERY_BOX << "x" << QUERY_BOX << " tiles around the middle\n";
+    IntVec2 min = {WORLD_SIZE/2 - QUERY_BOX/2, WORLD_SIZE/2 - QUERY_BOX/2};
+    IntVec2 max = min + (IntVec2){QUERY_BOX, QUERY_BOX};
+    bool same = true;
+
+    // Reading a box
+    unsigned long long tile_sum = 0, span_sum = 0;
+    auto start = chrono::steady_clock::now();
+    for(int r = 0;r<QUERY_ROUNDS;++r)
+        for(int x = min.x;x<max.x;++x)
+            for(int y = min.y;y<max.y;++y)
+                tile_sum += World.get_tile({x, y}).id;
+    double tile_ms = ms_since(start);
+    start = chrono::steady_clock::now();
+    for(int r = 0;r<QUERY_ROUNDS;++r) {
+        World.for_each_span(min, max, [&span_sum](const world_map::chunk_span &s) {
+            for(int x = s.min.x;x<s.max.x;++x)
+                for(int y = s.min.y;y<s.max.y;++y)
+                    span_sum += s.c->get(x%16, y%16).id;
+        });
+    }
+    double span_ms = ms_since(start);
+    same &= tile_sum == span_sum;
+    cout << "  Box reads:    " << tile_ms << " ms a tile at a time, " << span_ms << " ms by chunk spans\n";
+
+    // Every tile's neighbours, as the shading masks read them
+    unsigned long long tile_masks = 0, view_masks = 0;
+    start = chrono::steady_clock::now();
+    for(int x = min.x;x<max.x;++x)
+        for(int y = min.y;y<max.y;++y)
+            tile_masks += World.compute_adjacency({x, y});
+    tile_ms = ms_since(start);
+    start = chrono::steady_clock::now();
+    World.for_each_span(min, max, [&view_masks](const world_map::chunk_span &s) {
+        world_map::chunk_view v = World.view(s.c_pos);
+        for(int x = s.min.x;x<s.max.x;++x)
+            for(int y = s.min.y;y<s.max.y;++y)
+                view_masks += v.adjacency(x - s.c_pos.x*16, y - s.c_pos.y*16);
+    });
+    double view_ms = ms_since(start);
+    same &= tile_masks == view_masks;
+    cout << "  Neighbours:   " << tile_ms << " ms a tile at a time, " << view_ms << " ms by halo views\n";
+
+    // Rays out from the middle to the first wall
+    Vector2 middle = {WORLD_SIZE/2 + 0.5f, WORLD_SIZE/2 + 0.5f};
+    unsigned long long tile_hits = 0, ray_hits = 0;
+    start = chrono::steady_clock::now();
+    for(int i = 0;i<QUERY_RAYS;++i) {
+        float angle = i * 2 * PI / QUERY_RAYS;
+        IntVec2 hit;
+        if(World.cast_ray(middle, {middle.x + cos(angle)*QUERY_BOX/2, middle.y + sin(angle)*QUERY_BOX/2}, [](IntVec2 pos, const tiles::tile &) {
+            return tiles::is_collidable(World.get_tile(pos).id);
+        }, hit))
+            tile_hits += hit.x * 65536ULL + hit.y;
+    }
+    tile_ms = ms_since(start);
+    start = chrono::steady_clock::now();
+    for(int i = 0;i<QUERY_RAYS;++i) {
+        float angle = i * 2 * PI / QUERY_RAYS;
+        IntVec2 hit;
+        if(World.cast_ray(middle, {middle.x + cos(angle)*QUERY_BOX/2, middle.y + sin(angle)*QUERY_BOX/2}, [](IntVec2, const tiles::tile &t) {
+            return tiles::is_collidable(t.id);
+        }, hit))
+            ray_hits += hit.x * 65536ULL + hit.y;
+    }
+    double ray_ms = ms_since(start);
+    same &= tile_hits == ray_hits;
+    cout << "  Rays:         " << tile_ms << " ms looking up each tile, " << ray_ms << " ms looking up each chunk\n";
+
+    // Writing a checkerboard of walls into the box and putting the box back
+    vector<pair<IntVec2, tiles::tile>> before, pattern;
+    for(int x = min.x;x<max.x;++x) {
+        for(int y = min.y;y<max.y;++y) {
+            before.push_back({{x, y}, World.get_tile({x, y})});
+            pattern.push_back({{x, y}, (x + y) % 2 ? tiles::from_id(tiles::ID::INSULATION) : (tiles::tile){tiles::ID::VACUMN, 0}});
+        }
+    }
+    start = chrono::steady_clock::now();
+    for(auto &edit : pattern)
+        World.set_tile({(unsigned short)(edit.first.x%16), (unsigned short)(edit.first.y%16)}, {(unsigned short)(edit.first.x/16), (unsigned short)(edit.first.y/16)}, edit.second);
+    tile_ms = ms_since(start);
+    unsigned long long tile_hash = world_hash(World);
+    for(auto &edit : before)
+        World.set_tile({(unsigned short)(edit.first.x%16), (unsigned short)(edit.first.y%16)}, {(unsigned short)(edit.first.x/16), (unsigned short)(edit.first.y/16)}, edit.second);
+    start = chrono::steady_clock::now();
+    World.set_tiles(pattern);
+    double batch_ms = ms_since(start);
+    same &= world_hash(World) == tile_hash;
+    World.set_tiles(before);
+    same &= World.check_adjacency() == 0;
+    cout << "  Box writes:   " << tile_ms << " ms a tile at a time, " << batch_ms << " ms batched\n";
+    report("  Results", same);
+}
+
+// Hash of one chunk's tiles, the same as world_hash() adds up
+unsigned long long planes_hash(UShortVec2 pos, const tile_planes &planes) {
+    unsigned long long h = Random::mix(pos.x * 65536ULL + pos.y);
+    for(int x = 0;x<16;++x)
+        for(int y = 0;y<16;++y)
+            h = Random::mix(h ^ (planes.id[x][y] * 65536ULL + planes.mass[x][y]));
+    return h;
+}
+
+// What fill_circle did before it went through spans, every tile in the bounding square tested with dist()
+void fill_circle_by_tile(world_map &w, IntVec2 pos, int radius, tiles::tile tile, int randomize) {
+    stamp s = {pos, radius, tile, randomize};
+    if(s.gated() && w.get_tile(pos).id != tiles::ID::STONE)
+        return;
+    vector<pair<IntVec2, tiles::tile>> edits;
+    for(int x = s.min().x;x<s.max().x;++x) {
+        for(int y = s.min().y;y<s.max().y;++y) {
+            if(x < 0 || y < 0 || x > WORLD_SIZE || y > WORLD_SIZE || dist(pos, (IntVec2){x, y}) > radius/2 || !s.picked({x, y}))
+                continue;
+            edits.push_back({{x, y}, tile});
+        }
+    }
+    w.set_tiles(edits);
+}
+
+// Times filling chunks from the generation stamps and carving caves into two copies of the world,
+// the old way a tile at a time against by row spans, and checks both ways come out the same
+void carving_benchmarks() {
+    cout << padded("Carving") << "generation stamps and caves\n";
+    bool same = true;
+
+    // Every chunk's generated terrain
+    unsigned long long tile_hash = 0, span_hash = 0;
+    chunk filled;
+    tile_planes planes;
+    auto start = chrono::steady_clock::now();
+    for(unsigned short y = 0;y<CHUNK_COUNT;++y) {
+        for(unsigned short x = 0;x<CHUNK_COUNT;++x) {
+            for(int tx = 0;tx<16;++tx) {
+                for(int ty = 0;ty<16;++ty) {
+                    tiles::tile t = World.terrain_tile({x*16 + tx, y*16 + ty});
+                    planes.id[tx][ty] = t.id;
+                    planes.mass[tx][ty] = tiles::pack_mass(t.mass);
+                }
+            }
+            filled.store.assign(planes);
+            filled.store.compact();
+            filled.store.copy_to(planes);
+            tile_hash += planes_hash({x, y}, planes);
+        }
+    }
+    double tile_ms = ms_since(start);
+    start = chrono::steady_clock::now();
+    for(unsigned short y = 0;y<CHUNK_COUNT;++y) {
+        for(unsigned short x = 0;x<CHUNK_COUNT;++x) {
+            World.fill_terrain(&filled, {x, y});
+            filled.store.copy_to(planes);
+            span_hash += planes_hash({x, y}, planes);
+        }
+    }
+    double span_ms = ms_since(start);
+    same &= tile_hash == span_hash;
+    cout << "  Terrain:      " << CHUNK_COUNT * CHUNK_COUNT << " chunks in " << tile_ms << " ms a tile at a time, " << span_ms << " ms by spans\n";
+
+    // Caves, ore pockets and gated deposits crossing each other around the middle
+    world_map * worlds[2] = {new world_map(), new world_map()};
+    double carve_ms[2];
+    for(int w = 0;w<2;++w) {
+        worlds[w]->set_threads(1);
+        build_world(*worlds[w]);
+        start = chrono::steady_clock::now();
+        for(int i = 0;i<CARVE_CHECK_CAVES;++i) {
+            Random::Stream rng(Random::CAVE, -1 - i);
+            IntVec2 pos = {WORLD_SIZE/2 - QUERY_BOX + rng.Int(QUERY_BOX*2), WORLD_SIZE/2 - QUERY_BOX + rng.Int(QUERY_BOX*2)};
+            tiles::tile tile = i%3 == 0 ? (tiles::tile){tiles::ID::OXYGEN, 1000} : i%3 == 1 ? tiles::from_id(tiles::ID::SILT) : tiles::from_id(tiles::ID::COPPER);
+            if(i%3 == 2) {
+                int radius = rng.Int(1, 5);
+                if(w)
+                    worlds[w]->fill_circle(pos, radius, tile, 2);
+                else
+                    fill_circle_by_tile(*worlds[w], pos, radius, tile, 2);
+                continue;
+            }
+            int size = rng.Int(MIN_CAVE_SIZE, MAX_CAVE_SIZE);
+            int len = rng.Int(MIN_CAVE_LEN, MAX_CAVE_LEN);
+            if(w) {
+                worlds[w]->generate_cave(pos, size, len, tile, rng);
+                continue;
+            }
+            vector<stamp> path;
+            worlds[w]->cave_stamps(pos, size, len, tile, rng, path);
+            for(stamp &s : path)
+                fill_circle_by_tile(*worlds[w], s.pos, s.radius, s.tile, s.randomize);
+        }
+        carve_ms[w] = ms_since(start);
+    }
+    same &= world_hash(*worlds[0]) == world_hash(*worlds[1]) && worlds[1]->check_adjacency() == 0;
+    cout << "  Caves:        " << CARVE_CHECK_CAVES << " in " << carve_ms[0] << " ms a circle at a time, " << carve_ms[1] << " ms by spans\n";
+    for(world_map * w : worlds) {
+        w->stop_update_thread();
+        delete w;
+    }
+    report("  Results", same);
+}
+
+// Random lookups through the grid of chunk slots against the map keyed by id() it replaced, on the same chunks
+void lookup_benchmarks() {
+    cout << padded("Lookups") << LOOKUP_COUNT << " random tiles and chunks over " << World.chunks.size() << " chunks\n";
+    map<UShortVec2, chunk *> by_id;
+    World.chunks.for_each([&by_id](UShortVec2 pos, chunk * c) {
+        by_id[pos] = c;
+    });
+    auto map_find = [&by_id](UShortVec2 pos) -> chunk * {
+        auto it = by_id.find(pos);
+        return it == by_id.end() ? nullptr : it->second;
+    };
+
+    // Worked out first so only the lookups are timed
+    Random::Stream rng(Random::TERRAIN, -2);
+    vector<IntVec2> tiles(LOOKUP_COUNT);
+    for(IntVec2 &pos : tiles)
+        pos = {rng.Int(WORLD_SIZE + 1), rng.Int(WORLD_SIZE + 1)};
+    vector<UShortVec2> chunk_positions(LOOKUP_COUNT);
+    for(UShortVec2 &pos : chunk_positions)
+        pos = {(unsigned short)rng.Int(CHUNK_COUNT), (unsigned short)rng.Int(CHUNK_COUNT)};
+
+    // get_tile without the waiting commands, the terrain is what is there when the chunk is not stored
+    double tile_ms[2], chunk_ms[2];
+    unsigned long long tile_sum[2] = {}, chunk_sum[2] = {};
+    for(int w = 0;w<2;++w) {
+        auto start = chrono::steady_clock::now();
+        for(IntVec2 pos : tiles) {
+            UShortVec2 c_pos = {(unsigned short)(pos.x/16), (unsigned short)(pos.y/16)};
+            chunk * c = w ? World.chunks.find(c_pos) : map_find(c_pos);
+            tile_sum[w] += c ? c->packed(pos.x%16, pos.y%16).id : World.terrain_tile(pos).id;
+        }
+        tile_ms[w] = ms_since(start);
+
+        start = chrono::steady_clock::now();
+        for(UShortVec2 pos : chunk_positions) {
+            chunk * c = w ? World.chunks.find(pos) : map_find(pos);
+            chunk_sum[w] += c ? c->biome + 1 : 0;
+        }
+        chunk_ms[w] = ms_since(start);
+    }
+    cout << "  Tiles:        " << tile_ms[0] << " ms through the map, " << tile_ms[1] << " ms through the grid\n";
+    cout << "  Chunks:       " << chunk_ms[0] << " ms through the map, " << chunk_ms[1] << " ms through the grid\n";
+    report("  Results", tile_sum[0] == tile_sum[1] && chunk_sum[0] == chunk_sum[1]);
+}
+
+// Runs every gas kernel this CPU has on the same random halos, they all have to give exactly what the scalar one does
+void kernel_benchmarks() {
+    cout << padded("Gas kernels") << KERNEL_ROUNDS << " rounds of " << KERNEL_CHECK_HALOS << " random chunks\n";
+    // Masses as gather_halo gives them, nothing for tiles that are not gas
+    Random::Stream rng(Random::TERRAIN, -3);
+    vector<gas_kernel::halo> halos(KERNEL_CHECK_HALOS);
+    for(gas_kernel::halo &h : halos) {
+        for(int x = 0;x<18;++x) {
+            for(int y = 0;y<18;++y) {
+                h.air[x][y] = rng.Int(4) ? -1 : 0;
+                h.mass[x][y] = h.air[x][y] ? rng.Int(MAX_MASS + 1) : 0;
+            }
+        }
+    }
+
+    vector<array<short, 256>> expected(halos.size()), flows(halos.size());
+    bool same = true;
+    for(gas_kernel::kernel k : gas_kernel::available()) {
+        for(size_t i = 0;i<halos.size();++i)
+            k(halos[i], (short (*)[16])flows[i].data());
+        if(k == gas_kernel::diffuse_scalar)
+            expected = flows;
+        same &= flows == expected;
+
+        auto start = chrono::steady_clock::now();
+        for(int r = 0;r<KERNEL_ROUNDS;++r)
+            for(size_t i = 0;i<halos.size();++i)
+                k(halos[i], (short (*)[16])flows[i].data());
+        double s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        same &= flows == expected;
+        cout << "  " << gas_kernel::name(k) << string(14 - strlen(gas_kernel::name(k)), ' ')
+             << (long long)(s > 0 ? KERNEL_ROUNDS * halos.size() * 256 / s : 0) << " tiles/s\n";
+    }
+    report("  Results", same);
+}
+
+// Ticks a world with a band of gas across it on every thread count up to the number of cores, which all have to end up the same
+void thread_sweep() {
+    cout << padded("Thread sweep") << SCALING_TICKS << " ticks of a world with " << SCALING_BAND << " rows of chunks full of gas\n";
+    // Uneven gas that takes a long time to settle, in rows of stored chunks near the bottom of the world
+    vector<pair<IntVec2, tiles::tile>> band;
+    for(int y = 16;y<16*(1 + SCALING_BAND);++y)
+        for(int x = 0;x<CHUNK_COUNT*16;++x)
+            band.push_back({{x, y}, {tiles::ID::OXYGEN, (float)((x % 256) * 6 + Random::Rand(y*65536LL + x) * 400)}});
+
+    unsigned int cores = std::max(thread::hardware_concurrency(), 1u);
+    unsigned long long first_hash = 0;
+    bool same = true;
+    for(unsigned int threads = 1;threads<=cores;++threads) {
+        auto w = make_unique<world_map>();
+        w->set_threads(threads);
+        build_world(*w);
+        w->set_tiles(band);
+        size_t awake = w->awake_chunks.size();
+
+        auto start = chrono::steady_clock::now();
+        for(int i = 0;i<SCALING_TICKS;++i)
+            w->tick_update(nullptr);
+        w->finish_tick();
+        double ms = ms_since(start);
+
+        unsigned long long hash = world_hash(*w);
+        if(threads == 1)
+            first_hash = hash;
+        same &= hash == first_hash;
+        cout << "  " << threads << (threads == 1 ? " thread:     " : " threads:    ") << (ms > 0 ? SCALING_TICKS * 1000 / ms : 0) << " ticks/s, "
+             << awake << " chunks awake at the start, " << w->awake_chunks.size() << " at the end\n";
+        w->stop_update_thread();
+    }
+
+    // The thread count changed between the ticks of a world that is already running, with a tick in flight each time
+    auto w = make_unique<world_map>();
+    w->set_threads(1);
+    build_world(*w);
+    w->set_tiles(band);
+    for(int i = 0;i<SCALING_TICKS;++i) {
+        w->tick_update(nullptr);
+        if(i % 7 == 0)
+            w->set_threads(1 + (i / 7) % (cores + 1));
+    }
+    w->finish_tick();
+    same &= world_hash(*w) == first_hash;
+    cout << "  Changing:     " << SCALING_TICKS << " ticks going from 1 to " << cores + 1 << " threads\n";
+    w->stop_update_thread();
+    report("  Results", same);
+}
+
+// Walls, gas and empty tiles posted at random around the middle while the world ticks,
+// every shading mask has to stay what check_adjacency works out from scratch
+void adjacency_check() {
+    cout << padded("Adjacency") << ADJACENCY_CHECK_TICKS * ADJACENCY_CHECK_EDITS << " random edits over " << ADJACENCY_CHECK_TICKS << " ticks\n";
+    auto w = make_unique<world_map>();
+    w->set_threads(1);
+    build_world(*w);
+    Random::Stream rng(Random::TERRAIN, -4);
+    int wrong = 0;
+    for(int i = 0;i<ADJACENCY_CHECK_TICKS;++i) {
+        w->tick_update(nullptr);
+        for(int e = 0;e<ADJACENCY_CHECK_EDITS;++e) {
+            IntVec2 pos = {WORLD_SIZE/2 - QUERY_BOX/2 + rng.Int(QUERY_BOX), WORLD_SIZE/2 - QUERY_BOX/2 + rng.Int(QUERY_BOX)};
+            int kind = rng.Int(3);
+            tiles::tile t = kind == 0 ? tiles::from_id(tiles::ID::INSULATION) : kind == 1 ? (tiles::tile){tiles::ID::OXYGEN, (float)rng.Int(100, 2000)} : (tiles::tile){tiles::ID::VACUMN, 0};
+            w->post({world_command::SET_TILE, pos, t});
+        }
+        w->finish_tick();
+        if(i % 10 == 9)
+            wrong += w->check_adjacency();
+    }
+    w->stop_update_thread();
+    report("  Results", !wrong);
+}
+
+// Saves every chunk, loads it back into a new world and checks the two match, then that saving again only writes what changed
+void save_check(const string &dir) {
+    std::error_code error;
+    filesystem::remove_all(dir, error);
+
+    // The worst case, every chunk in the world edited
+    store_everything();
+    memory_report("Stored world:   ", World);
+    unsigned long long hash = world_hash(World);
+
+    World.save(dir);
+    double snapshot_ms = World.save_stats.snapshot_ms;
+    World.wait_for_save();
+    ostringstream detail;
+    detail << World.save_stats.chunks << " chunks in " << World.save_stats.regions << " regions, "
+           << pretty_size(World.save_stats.bytes) << ", " << snapshot_ms << " ms on the game thread, " << World.save_stats.write_ms << " ms writing";
+    report("Save", World.save_stats.ok, detail.str(), "FAILED");
+
+    auto loaded = make_unique<world_map>();
+    auto start = chrono::steady_clock::now();
+    bool ok = loaded->load(dir);
+    double load_ms = ms_since(start);
+    start = chrono::steady_clock::now();
+    for(unsigned short y = 0;y<CHUNK_COUNT;++y)
+        for(unsigned short x = 0;x<CHUNK_COUNT;++x)
+            loaded->chunks.find({x, y});
+    double decode_ms = ms_since(start);
+    cout << padded("Load") << load_ms << " ms to map, " << decode_ms << " ms to decode every chunk\n";
+    report("Round trip", ok && world_hash(*loaded) == hash && loaded->sim_ticks == World.sim_ticks);
+
+    // Saving again only writes what changed
+    World.set_tile({0, 0}, {1, 1}, tiles::from_id(tiles::ID::INSULATION));
+    World.save(dir);
+    World.wait_for_save();
+    detail.str("");
+    detail << World.save_stats.chunks << " chunks encoded and " << World.save_stats.kept << " kept in " << World.save_stats.regions << " regions, "
+           << World.save_stats.write_ms << " ms writing";
+    report("Resave", World.save_stats.ok, detail.str(), "FAILED");
+    loaded->stop_update_thread();
+
+    // Another edit saved to a different folder, the regions that did not change come across from the first one
+    string copy_dir = dir + "-copy";
+    filesystem::remove_all(copy_dir, error);
+    World.set_tile({0, 0}, {CHUNK_COUNT/2, CHUNK_COUNT/2}, tiles::from_id(tiles::ID::INSULATION));
+    World.save(copy_dir);
+    World.wait_for_save();
+    auto copy = make_unique<world_map>();
+    bool copy_loaded = copy->load(copy_dir);
+    for(unsigned short y = 0;y<CHUNK_COUNT;++y)
+        for(unsigned short x = 0;x<CHUNK_COUNT;++x)
+            copy->chunks.find({x, y});
+    detail.str("");
+    detail << World.save_stats.chunks << " chunks encoded, " << World.save_stats.kept << " kept, " << World.save_stats.copied << " regions copied";
+    report("Save elsewhere", copy_loaded && World.save_stats.ok && world_hash(*copy) == world_hash(World), detail.str());
+    copy->stop_update_thread();
+    filesystem::remove_all(copy_dir, error);
+}
+
+// Stores every chunk, sweeps the focus over the world with a page budget in bytes and checks the chunks come back the same
+void paging_check(long budget) {
+    World.page_budget = budget;
+    store_everything();
+    vector<tile_planes> before = all_planes();
+    vector<char> simulated(before.size());
+
+    // Walk the focus along every row of chunks, ticking as it goes
+    auto start = chrono::steady_clock::now();
+    int page_ticks = 0;
+    for(int y = 0;y<=WORLD_SIZE;y+=16*PAGE_KEEP_RADIUS) {
+        for(int x = 0;x<=WORLD_SIZE;x+=16) {
+            World.page_focus = {(y/(16*PAGE_KEEP_RADIUS)) % 2 ? WORLD_SIZE - x : x, y};
+            World.tick_update(nullptr);
+            for(auto &sim : World.sim_chunks)
+                simulated[sim.first.y*CHUNK_COUNT + sim.first.x] = 1;
+            World.finish_tick();
+            ++page_ticks;
+        }
+    }
+    double page_ms = ms_since(start);
+    cout << padded("Paging") << page_ticks << " ticks in " << page_ms << " ms, " << World.chunks.size() << " chunks in memory ("
+         << pretty_size(World.chunks.memory()) << "), " << World.chunks.pending_count << " paged out\n";
+    cout << padded("Page counters") << World.page_stats.hits << " hits, " << World.page_stats.misses << " misses, "
+         << World.page_stats.evictions << " evictions, " << World.page_stats.prefetches << " prefetches\n";
+    // Chunks the gas moved through are left out
+    vector<tile_planes> after = all_planes();
+    size_t different = 0;
+    for(size_t i = 0;i<before.size();++i)
+        if(!simulated[i] && memcmp(&before[i], &after[i], sizeof(tile_planes)) != 0)
+            ++different;
+    report("Paged world", !different, different ? to_string(different) + " chunks different" : "");
+}
+
+double percentile(vector<double> &sorted, double p) {
+    if(sorted.empty())
+        return 0;
+    return sorted[(size_t)(p * (sorted.size() - 1) + 0.5)];
+}
+
+
+int main(int argc, char ** argv) {
+    int seed = argc > 1 ? atoi(argv[1]) : 0;
+    int tick_count = argc > 2 ? atoi(argv[2]) : 1000;
+    unsigned int threads = argc > 3 ? atoi(argv[3]) : SIM_THREADS;
+
+    profiler::name_thread("Main");
+    Random::init(seed);
+
+    auto gen_start = chrono::steady_clock::now();
+    World.set_threads(threads);
+    build_world(World);
+    double gen_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - gen_start).count();
+
+    // Each tick is timed from dispatch to swap so the worker time is included
+    vector<double> tick_ms;
+    tick_ms.reserve(tick_count);
+    unsigned long long tiles_updated = 0;
+    unsigned long long tiles_read = 0;
+    auto sim_start = chrono::steady_clock::now();
+    for(int i = 0;i<tick_count;++i) {
+        auto start = chrono::steady_clock::now();
+        World.tick_update(nullptr);
+        tiles_updated += World.sim_chunks.size() * 256;
+        // The workers only read the published front buffers, so the main thread can read them too
+        read_like_renderer(World);
+        tiles_read += (RENDER_CHECK_RADIUS*2 + 1) * (RENDER_CHECK_RADIUS*2 + 1) * 256;
+        World.finish_tick();
+        profiler::end_frame();
+        tick_ms.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+    }
+    double sim_s = chrono::duration<double>(chrono::steady_clock::now() - sim_start).count();
+    World.finish_tick();
+
+    sort(tick_ms.begin(), tick_ms.end());
+    cout << "Seed:           " << seed << "\n";
+    cout << "Threads:        " << (threads ? threads : thread::hardware_concurrency()) << "\n";
+    cout << "Kernel:         " << gas_kernel::name(World.diffuse) << "\n";
+    cout << "Chunks:         " << World.chunks.size() << " stored, " << World.awake_chunks.size() << " awake, " << pretty_size(World.chunks.memory()) << "\n";
+    cout << "Generation:     " << gen_ms << " ms\n";
+    cout << "World hash:     " << world_hash(World) << "\n";
+    cout << "Ticks:          " << tick_count << " in " << sim_s << " s\n";
+    cout << "Tick p50:       " << percentile(tick_ms, 0.5) << " ms\n";
+    cout << "Tick p90:       " << percentile(tick_ms, 0.9) << " ms\n";
+    cout << "Tick p99:       " << percentile(tick_ms, 0.99) << " ms\n";
+    cout << "Tick max:       " << (tick_ms.empty() ? 0 : tick_ms.back()) << " ms\n";
+    cout << "Tiles/second:   " << (long long)(sim_s > 0 ? tiles_updated / sim_s : 0) << "\n";
+    cout << "Tiles read:     " << tiles_read << " by the main thread during ticks\n";
+    cout << "Peak memory:    " << pretty_size(peak_memory()) << "\n";
+    // Worker zones are added up over every worker
+    cout << "Profile:        p50 / p99 ms per tick over the last " << std::min((size_t)tick_count, (size_t)PROFILE_FRAMES) << " ticks\n";
+    for(profiler::zone_stats &zone : profiler::zones)
+        cout << "  " << string(zone.depth * 2, ' ') << zone.name << ": " << zone.p50 << " / " << zone.p99 << "\n";
+    profiler::enabled = false;
+
+    edit_check();
+    queue_check();
+    collision_check();
+    query_benchmarks();
+    carving_benchmarks();
+    kernel_benchmarks();
+    thread_sweep();
+    adjacency_check();
+    // With every chunk stored, like a world that has been played through
+    store_everything();
+    lookup_benchmarks();
+    if(argc > 4 && string(argv[4]) != "-")
+        save_check(argv[4]);
+    if(argc > 5)
+        paging_check(atol(argv[5]) * 1000);
+
+    World.stop_update_thread();
+    return failed ? 1 : 0;
+}
@@ -10,6 +10,9 @@
 #include "src/player.cpp"
 
 #include "src/random.h"
+#include "src/tick_scheduler.h"
+#include "src/profiler.h"
+#include "src/collision.h"
 
 using namespace std;
 
@@ -29,7 +32,8 @@ using namespace std;
 #endif
 
 #define DEBUG false
-#define TPS 10
+#define SAVE_DIR "saves/world"
+#define TRACE_FILE "trace.json"
 
 float tile_scale = 2.0f;
 
@@ -48,15 +52,14 @@ Vector2 mouse;
 
 // Global world variables
 world_map World;
-long long ticks; // The ticks elapsed since game start
-
-bool check_collision(_player * Player) {
-    Player->collision = 
-    tiles::is_collidable(World.get_tile({(int)(Player->position.x/50 + 0.4), (int)(Player->position.y/50 + 1.4)}).id) ||
-    tiles::is_collidable(World.get_tile({(int)(Player->position.x/50 - 0.4), (int)(Player->position.y/50 + 0.6)}).id) ||
-    tiles::is_collidable(World.get_tile({(int)(Player->position.x/50 - 0.4), (int)(Player->position.y/50 + 1.4)}).id) ||
-    tiles::is_collidable(World.get_tile({(int)(Player->position.x/50 + 0.4), (int)(Player->position.y/50 + 0.6)}).id);
-    return Player->collision;
+tick_scheduler Scheduler;
+collision_system Collisions;
+
+void move_bodies() {
+    Collisions.changed(World.solid_changes, World.last_solid_change);
+    Collisions.update(GetFrameTime(), [](IntVec2 pos) {
+        return tiles::is_collidable(World.get_tile(pos).id);
+    });
 }
 
 void handle_input(_player * Player, float tile_w, Vector2 center) {
@@ -112,14 +115,10 @@ void handle_input(_player * Player, float tile_w, Vector2 center) {
         movement_v.y = cos(Player->rotation/(180/PI)) * PLAYER_SPEED;
     }
         
-    // Update the positions
-    Player->position.x += movement_v.x * (60 / (1/GetFrameTime()));
-    if(check_collision(Player))
-        Player->position.x -= movement_v.x * (60 / (1/GetFrameTime()));
-
-    Player->position.y += movement_v.y * (60 / (1/GetFrameTime()));
-    if(check_collision(Player))
-        Player->position.y -= movement_v.y * (60 / (1/GetFrameTime()));
+    // Update the positions, movement_v is in pixels a frame at 60 frames a second
+    Player->box.velocity = {movement_v.x * 60 / 50, movement_v.y * 60 / 50};
+    move_bodies();
+    Player->follow_box();
 
     // Update mouse location
     if(!using_gamepad)
@@ -151,7 +150,6 @@ void handle_input(_player * Player, float tile_w, Vector2 center) {
     if(x != Player->select.x || y != Player->select.y) {
         Player->select = {x, y};
         Player->digging = false;
-        Player->interact = false;
         Player->dig_progress = 0;
     }
 
@@ -165,18 +163,15 @@ void handle_input(_player * Player, float tile_w, Vector2 center) {
                 Player->digging = true;
                 Player->dig_progress = 0;
             }
-            if(IsMouseButtonDown(MOUSE_RIGHT_BUTTON) && tiles::is_air(World.get_tile((IntVec2){x, y}).id))
-                World.set_tile({ 
-                    (unsigned short)(Player->select.x%16), 
-                    (unsigned short)(Player->select.y%16) 
-                }, { 
-                    (unsigned short)(Player->select.x/16), 
-                    (unsigned short)(Player->select.y/16) 
-                },
-                {tiles::ID::INSULATION, 1500});
+            // Only posted when it changes the tile, not every frame the button is held
+            if(IsMouseButtonDown(MOUSE_RIGHT_BUTTON)) {
+                tiles::tile current = World.get_tile((IntVec2){x, y});
+                if(tiles::is_air(current.id))
+                    World.post({world_command::SET_TILE, Player->select, {tiles::ID::INSULATION, 1500}});
+            }
         }
-        if(IsMouseButtonReleased(MOUSE_RIGHT_BUTTON) && !Player->interact)
-            Player->interact = true;
+        if(IsMouseButtonReleased(MOUSE_RIGHT_BUTTON))
+            World.post({world_command::INTERACT, Player->select});
 
         if(Player->digging && IsMouseButtonReleased(MOUSE_LEFT_BUTTON))
             Player->digging = false;
@@ -184,7 +179,7 @@ void handle_input(_player * Player, float tile_w, Vector2 center) {
     else {
         if(GetGamepadAxisCount(0) > 4) {
             if(!ltrigger && GetGamepadAxisMovement(0, 4) > 0)
-                Player->interact = true;
+                World.post({world_command::INTERACT, Player->select});
             Player->digging = rtrigger;
             rtrigger = GetGamepadAxisMovement(0, 5) > 0;
             ltrigger = GetGamepadAxisMovement(0, 4) > 0;
@@ -228,8 +223,11 @@ void handle_input(_player * Player, float tile_w, Vector2 center) {
     }
 }
 
-int main() {
-    Structure start_zone = LoadStructure("resources/structures/start_zone.struct");
+int main(int argc, char ** argv) {
+    profiler::name_thread("Main");
+    // Only pick up the quick save when asked to, with --load
+    bool load_save = argc > 1 && string(argv[1]) == "--load";
+    const Structure &start_zone = LoadStructure("resources/structures/start_zone.struct");
 
     // Init window
     Vector2 base_size = {800, 500};
@@ -240,16 +238,24 @@ int main() {
     
     // Init player
     _player Player = _player(&window_size);
-    Player.position = { WORLD_SIZE * 25, WORLD_SIZE * 25 }; // Middle of the map
+    Player.place({ WORLD_SIZE * 25, WORLD_SIZE * 25 }); // Middle of the map
+    Collisions.add(&Player.box);
 
     // Init map
     World = world_map();
     World.mouse = &mouse;
-    World.generate();
-    World.generate_cave({(WORLD_SIZE/2), (WORLD_SIZE/2) - 3}, 10, 9, {tiles::ID::OXYGEN, 1400});
-    World.generate_cave((IntVec2){(WORLD_SIZE/2), (WORLD_SIZE/2) - 6}, 3, 3, {tiles::ID::SILT, 1200});
-    
-    World.place_structure(start_zone, {(WORLD_SIZE/2)-(start_zone.width/2), WORLD_SIZE/2-(start_zone.height/2)});
+    if(load_save && World.load(SAVE_DIR)) {
+        cout << "GAME: Loaded world from " << SAVE_DIR << endl;
+    }
+    else {
+        // The starting caves go in before the start zone, which is built over them
+        vector<stamp> start_caves;
+        World.cave_stamps({(WORLD_SIZE/2), (WORLD_SIZE/2) - 3}, 10, 9, {tiles::ID::OXYGEN, 1400}, start_caves);
+        World.cave_stamps((IntVec2){(WORLD_SIZE/2), (WORLD_SIZE/2) - 6}, 3, 3, {tiles::ID::SILT, 1200}, start_caves);
+        World.generate([](const char * stage, float progress) {
+            cout << "Generating World: " << stage << " " << round(progress*1000)/10 << "%\n";
+        }, {{&start_zone, {(WORLD_SIZE/2)-(start_zone.width/2), WORLD_SIZE/2-(start_zone.height/2)}}}, start_caves);
+    }
     
 
     // Load textures
@@ -259,15 +265,15 @@ int main() {
     // Rendering speed variables
     SetTargetFPS(120);
     float fps = 30;
-    float avg_wr_ms = 5;
-    float avg_ms = 5;
-    clock_t wr_start, wr_end, render_start, render_end;
+    bool show_profile = false;
 
     // The size of a tile
     float tile_w = tiles::sprites[1].width * tile_scale;
 
     // Main game loop
     while (!WindowShouldClose()) {
+        profiler::scope frame_zone("Frame");
+
         // Update window variables
         if(window_size.x != GetRenderWidth() || window_size.y != GetRenderHeight()) {
             window_size = {(float)GetRenderWidth(), (float)GetRenderHeight()};
@@ -278,75 +284,117 @@ int main() {
         
         tile_w = tiles::sprites[1].width * tile_scale;
 
-        // Update the wall shading render texture
-        BeginTextureMode(tiles::shading_buffer);
-        ClearBackground((Color){0, 0, 0, 0});
-        EndTextureMode();
-
-        render_start = clock();
+        profiler::scope render_zone("Render");
         BeginDrawing();
             ClearBackground(BLACK);
 
-            wr_start = clock();
-
-            World.render(&Player, tile_w, tile_scale);
+            {
+                PROFILE_ZONE("World render");
+                World.render(&Player, tile_w, tile_scale);
+            }
 
-            wr_end = clock();
+            // Draw the gas and wall shading queued by the world
+            {
+                PROFILE_ZONE("Overlay flush");
+                tiles::flush_overlays();
+            }
 
-            Player.render();
+            {
+                PROFILE_ZONE("Player render");
+                Player.render();
+            }
 
             // Draw the wall shadows over the player to keep depth
             DrawTexture(tiles::shading_buffer.texture, 0, 0, WHITE);
             DrawTexture(cursor, mouse.x, mouse.y, WHITE);
 
             DrawText( to_string((int)fps).c_str(), 4, 4, 20, RAYWHITE);
+            DrawText( (Scheduler.fast_forward ? string("Fast forward ") + to_string(Scheduler.frame_ticks) + " ticks/frame" : to_string((int)Scheduler.tps) + " TPS").c_str(), 4, 26, 10, RAYWHITE);
+            if(Scheduler.lag() >= 1 || Scheduler.dropped)
+                DrawText( ("Behind " + to_string((int)Scheduler.lag()) + " ticks, " + to_string(Scheduler.dropped) + " dropped").c_str(), 4, 38, 10, RED);
+
+            // Where the last few seconds of frames went, in milliseconds per frame
+            if(show_profile) {
+                int line = 0;
+                DrawText("Zone  p50 / p90 / p99 ms", 4, 54, 10, YELLOW);
+                for(profiler::zone_stats &zone : profiler::zones) {
+                    char text[128];
+                    snprintf(text, sizeof(text), "%*s%s  %.2f / %.2f / %.2f", zone.depth * 2, "", zone.name.c_str(), zone.p50, zone.p90, zone.p99);
+                    DrawText(text, 4, 66 + 12*line++, 10, RAYWHITE);
+                }
+                if(profiler::tracing)
+                    DrawText("Recording trace, F4 to stop", 4, 66 + 12*line, 10, RED);
+            }
+        render_zone.end();
 
-        EndDrawing();
+        {
+            PROFILE_ZONE("Present");
+            EndDrawing();
+        }
         
         // Update time data
-        render_end = clock();
         fps = ((fps*30) + (1/GetFrameTime())) / 31;
-        avg_wr_ms = ((avg_wr_ms*10) + (float(wr_end-wr_start) / float(CLOCKS_PER_SEC))) / 11;
-        avg_ms = ((avg_ms*10) + (float(render_end-render_start) / float(CLOCKS_PER_SEC))) / 11;
 
         // Update player
         Player.size = {16 * tile_scale, 16 * tile_scale};
 
         // Handle the user input
-        handle_input(&Player, tile_w, {window_size.x/2, window_size.y/2});
+        {
+            PROFILE_ZONE("Input");
+            handle_input(&Player, tile_w, {window_size.x/2, window_size.y/2});
+        }
+
+        // F3 shows the profiler and F4 starts and stops recording a trace
+        if(IsKeyPressed(KEY_F3))
+            show_profile = !show_profile;
+        if(IsKeyPressed(KEY_F4)) {
+            if(!profiler::tracing)
+                profiler::start_trace();
+            else if(profiler::stop_trace(TRACE_FILE))
+                cout << "GAME: Wrote trace to " << TRACE_FILE << endl;
+        }
+
+        // Quick save, written in the background
+        if(IsKeyPressed(KEY_F5))
+            World.save(SAVE_DIR);
+
+        // Simulation speed, + and - change the ticks per second and F6 runs the simulation as fast as it can
+        if(IsKeyPressed(KEY_EQUAL) || IsKeyPressed(KEY_KP_ADD))
+            Scheduler.set_tps(Scheduler.tps * 2);
+        if(IsKeyPressed(KEY_MINUS) || IsKeyPressed(KEY_KP_SUBTRACT))
+            Scheduler.set_tps(Scheduler.tps / 2);
+        if(IsKeyPressed(KEY_F6))
+            Scheduler.fast_forward = !Scheduler.fast_forward;
 
-        if(ticks != int(GetTime()*TPS)) {
-            ticks = int(GetTime()*TPS);
+        profiler::scope simulation_zone("Simulation");
+        Scheduler.update(GetFrameTime(), [&]() {
             Player.tick_update( tiles::tile_prefabs[World.get_tile(Player.select).id].density);
             IntVec2 player_pos = (IntVec2){(int)(Player.position.x/50), (int)(Player.position.y/50)+1};
             tiles::tile t = World.get_tile(player_pos);
             if(t.id == tiles::ID::OXYGEN)
-                World.set_mass(player_pos, t.mass - 10);
+                World.post({world_command::SET_MASS, player_pos, {tiles::ID::VOID, t.mass - 10}});
             if(t.mass < 0)
-                World.set_mass(player_pos, 0);
+                World.post({world_command::SET_MASS, player_pos, {tiles::ID::VOID, 0}});
             World.tick_update(&Player);
             
             // Update player digging status
             if(Player.dig_progress>=1) {
-                World.set_tile({ 
-                    (unsigned short)(Player.select.x%16), 
-                    (unsigned short)(Player.select.y%16) 
-                }, { 
-                    (unsigned short)(Player.select.x/16), 
-                    (unsigned short)(Player.select.y/16) 
-                },
-                {tiles::ID::VACUMN, 0});
+                World.post({world_command::SET_TILE, Player.select, {tiles::ID::VACUMN, 0}});
                 Player.dig_progress = 0;
                 Player.digging = false;
             }
+        });
+        simulation_zone.end();
 
-            // Decrease load if framerate is struggling
-            if(fps <= 30) max_light_dist = fps/2;
-            else max_light_dist = 15;
-        }
+        // Decrease load if framerate is struggling
+        if(fps <= 30) max_light_dist = fps/2;
+        else max_light_dist = 15;
+
+        frame_zone.end();
+        profiler::end_frame();
     }
 
-    // Unload everything
+    // Unload everything, F5 is the only thing that saves
     World.stop_update_thread();
     Player.unload();
     CloseWindow();
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+#include "vec2.h"
+
+using namespace std;
+
+// Shapes turned into runs of tiles along each row, so carving writes whole runs instead of testing every tile in a bounding square
+namespace carve {
+    // The tiles from x0 up to but not including x1 on row y
+    struct span {
+        int y;
+        int x0, x1;
+    };
+
+    // How far either side of the middle a row dy away from it reaches in a circle of radius r, or -1 if it misses
+    // The same as the largest w with w*w + dy*dy <= r*r, so it agrees with dist() on whole tiles
+    inline int half_width(int r, int dy) {
+        int left = r*r - dy*dy;
+        if(left < 0)
+            return -1;
+        int w = (int)sqrt((double)left);
+        while(w*w > left)
+            --w;
+        while((w + 1)*(w + 1) <= left)
+            ++w;
+        return w;
+    }
+
+    // Tiles no more than r from centre, inside the box from min up to but not including max
+    inline void circle(IntVec2 centre, int r, IntVec2 min, IntVec2 max, vector<span> &out) {
+        int y0 = std::max(centre.y - r, min.y);
+        int y1 = std::min(centre.y + r + 1, max.y);
+        for(int y = y0;y<y1;++y) {
+            int w = half_width(r, y - centre.y);
+            int x0 = std::max(centre.x - w, min.x);
+            int x1 = std::min(centre.x + w + 1, max.x);
+            if(x0 < x1)
+                out.push_back({y, x0, x1});
+        }
+    }
+
+    // Sorts the runs by row and joins any that overlap or touch, so every tile is in at most one run
+    inline void merge(vector<span> &spans) {
+        sort(spans.begin(), spans.end(), [](const span &a, const span &b) {
+            return a.y != b.y ? a.y < b.y : a.x0 < b.x0;
+        });
+        size_t kept = 0;
+        for(size_t i = 0;i<spans.size();++i) {
+            if(kept && spans[kept - 1].y == spans[i].y && spans[i].x0 <= spans[kept - 1].x1)
+                spans[kept - 1].x1 = std::max(spans[kept - 1].x1, spans[i].x1);
+            else
+                spans[kept++] = spans[i];
+        }
+        spans.resize(kept);
+    }
+
+    inline bool contains(const vector<span> &spans, IntVec2 pos) {
+        for(const span &s : spans)
+            if(s.y == pos.y && pos.x >= s.x0 && pos.x < s.x1)
+                return true;
+        return false;
+    }
+};
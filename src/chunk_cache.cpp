@@ -0,0 +1,76 @@
+#pragma once
+
+#include "graphics.h"
+
+#include <unordered_map>
+
+using namespace std;
+
+#define CHUNK_CACHE_SIZE 64 // Baked chunks kept on the GPU at once
+
+// Each visible chunk's tiles drawn once into a texture and redrawn only when the chunk's revision changes
+// Least recently drawn chunks are dropped once the budget is reached, and chunks past the budget are left for the caller to draw tile by tile
+class chunk_cache {
+    struct entry {
+        RenderTexture2D texture;
+        unsigned int revision;
+        unsigned long long last_used;
+    };
+    unordered_map<const void *, entry> entries;
+    unsigned long long frame = 0;
+
+    public:
+
+    size_t budget = CHUNK_CACHE_SIZE;
+
+    void next_frame() {
+        ++frame;
+    }
+
+    // Returns the chunk's baked texture, calling bake() inside the texture if it is missing or out of date
+    // bake() draws the chunk with tile (0, 0) at the bottom left and a tile size of the sprite size
+    template<typename C, typename F> Texture2D * get(C * c, int size, F bake) {
+        auto e = entries.find(c);
+        if(e == entries.end()) {
+            if(entries.size() >= budget) {
+                auto oldest = entries.end();
+                for(auto i = entries.begin();i!=entries.end();++i) {
+                    if(oldest == entries.end() || i->second.last_used < oldest->second.last_used)
+                        oldest = i;
+                }
+                // Everything cached is already on screen
+                if(oldest->second.last_used == frame)
+                    return nullptr;
+                UnloadRenderTexture(oldest->second.texture);
+                entries.erase(oldest);
+            }
+            e = entries.insert({c, {LoadRenderTexture(size, size), 0, 0}}).first;
+            e->second.revision = c->revision - 1;
+        }
+
+        e->second.last_used = frame;
+        if(e->second.revision != c->revision) {
+            BeginTextureMode(e->second.texture);
+            ClearBackground((Color){0, 0, 0, 0});
+            bake();
+            EndTextureMode();
+            e->second.revision = c->revision;
+        }
+        return &e->second.texture.texture;
+    }
+
+    // For chunks that are about to be freed
+    void forget(const void * c) {
+        auto e = entries.find(c);
+        if(e == entries.end())
+            return;
+        UnloadRenderTexture(e->second.texture);
+        entries.erase(e);
+    }
+
+    void clear() {
+        for(auto &e : entries)
+            UnloadRenderTexture(e.second.texture);
+        entries.clear();
+    }
+};
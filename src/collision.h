@@ -0,0 +1,162 @@
+#pragma once
+
+#include <vector>
+#include <climits>
+#include <algorithm>
+#include <math.h>
+#include <cstring>
+
+#include "vec2.h"
+
+using namespace std;
+
+#define COLLISION_RADIUS 2         // Tiles kept either side of the tile a body is in
+#define COLLISION_STEP_RATE 120    // Movement steps a second
+#define MAX_COLLISION_STEPS 12     // Steps one frame runs before the rest of its time is dropped
+#define COLLISION_GAP 0.001f       // How far from a wall a body stops
+
+#define COLLISION_WINDOW (COLLISION_RADIUS*2 + 1)
+
+// A box moving through the tiles, in tile units
+struct body {
+    Vector2 position = {0, 0}; // Middle of the box
+    Vector2 half_size = {0.4f, 0.4f}; // Under half a tile, so the window around it covers anywhere it moves in one sweep
+    Vector2 velocity = {0, 0}; // Tiles a second
+    bool collision = false; // Whether it ran into a wall in the last step
+
+    // Which tiles around it are solid, only read again once it moves into another tile or a tile in it changes
+    IntVec2 window_origin = {INT_MIN, INT_MIN};
+    unsigned long long window_version = 0;
+    bool solid[COLLISION_WINDOW][COLLISION_WINDOW];
+
+    IntVec2 tile() const {
+        return {(int)floor(position.x), (int)floor(position.y)};
+    }
+};
+
+// Moves bodies at a fixed step whatever the frame rate is, sweeping each box along one axis then the other
+// so it stops against the first wall in its way however far it moves in a step
+class collision_system {
+    vector<body *> bodies;
+    double owed = 0; // Seconds of movement not run yet
+
+    // changes and last_change work like light_map's, a count of the world's solid tile changes and where the latest one was
+    unsigned long long changes = 0;
+    IntVec2 last_change = {0, 0};
+
+    static bool in_window_of(IntVec2 origin, IntVec2 pos) {
+        return abs(pos.x - origin.x) <= COLLISION_RADIUS && abs(pos.y - origin.y) <= COLLISION_RADIUS;
+    }
+    static bool in_window(const body &b, IntVec2 pos) {
+        return b.window_origin.x != INT_MIN && in_window_of(b.window_origin, pos);
+    }
+
+    template<typename F> void refresh(body &b, F is_solid) {
+        IntVec2 origin = b.tile();
+        // Whether what is in the window is still right
+        bool current = b.window_origin.x != INT_MIN && (changes == b.window_version || (changes == b.window_version + 1 && !in_window(b, last_change)));
+        b.window_version = changes;
+        if(origin == b.window_origin && current)
+            return;
+
+        // Moving into the next tile keeps most of the window, so only the tiles it did not have are read
+        bool old[COLLISION_WINDOW][COLLISION_WINDOW];
+        memcpy(old, b.solid, sizeof(old));
+        IntVec2 old_origin = b.window_origin;
+        b.window_origin = origin;
+        for(int x = 0;x<COLLISION_WINDOW;++x) {
+            for(int y = 0;y<COLLISION_WINDOW;++y) {
+                IntVec2 pos = {origin.x + x - COLLISION_RADIUS, origin.y + y - COLLISION_RADIUS};
+                if(current && in_window_of(old_origin, pos))
+                    b.solid[x][y] = old[pos.x - old_origin.x + COLLISION_RADIUS][pos.y - old_origin.y + COLLISION_RADIUS];
+                else {
+                    b.solid[x][y] = is_solid(pos);
+                    ++tiles_read;
+                }
+            }
+        }
+        ++refreshes;
+    }
+
+    static bool solid_at(const body &b, int x, int y) {
+        return b.solid[x - b.window_origin.x + COLLISION_RADIUS][y - b.window_origin.y + COLLISION_RADIUS];
+    }
+
+    // Moves along x (axis 0) or y (axis 1) by at most a tile, stopping short of the first solid column or row the box would enter
+    static bool sweep(body &b, int axis, float distance) {
+        float &pos = axis ? b.position.y : b.position.x;
+        float half = axis ? b.half_size.y : b.half_size.x;
+        float other = axis ? b.position.x : b.position.y;
+        float other_half = axis ? b.half_size.x : b.half_size.y;
+        int low = floor(other - other_half);
+        int high = floor(other + other_half);
+
+        int edge = distance > 0 ? floor(pos + half) : floor(pos - half);
+        int target = distance > 0 ? floor(pos + half + distance) : floor(pos - half + distance);
+        int dir = distance > 0 ? 1 : -1;
+        for(int line = edge + dir;line != target + dir;line += dir) {
+            for(int o = low;o<=high;++o) {
+                if(axis ? solid_at(b, o, line) : solid_at(b, line, o)) {
+                    pos = distance > 0 ? line - half - COLLISION_GAP : line + 1 + half + COLLISION_GAP;
+                    return true;
+                }
+            }
+        }
+        pos += distance;
+        return false;
+    }
+
+    public:
+    unsigned long long steps = 0;
+    unsigned long long refreshes = 0; // Times a body's window moved or was read in again
+    unsigned long long tiles_read = 0;
+
+    void add(body * b) {
+        bodies.push_back(b);
+    }
+    void remove(body * b) {
+        bodies.erase(std::remove(bodies.begin(), bodies.end(), b), bodies.end());
+    }
+
+    // Tells the bodies a tile that was or is solid changed
+    void changed(unsigned long long world_changes, IntVec2 world_last_change) {
+        changes = world_changes;
+        last_change = world_last_change;
+    }
+
+    // Moves every body by one step, is_solid(IntVec2) says whether a tile blocks movement
+    template<typename F> void step(float dt, F is_solid) {
+        ++steps;
+        for(body * b : bodies) {
+            b->collision = false;
+            float dx = b->velocity.x * dt;
+            float dy = b->velocity.y * dt;
+            // Split into moves of under a tile, so the window around the box always covers where it is going
+            int parts = (int)ceil(std::max(fabs(dx), fabs(dy)));
+            if(parts < 1)
+                parts = 1;
+            for(int i = 0;i<parts;++i) {
+                refresh(*b, is_solid);
+                if(dx && sweep(*b, 0, dx / parts))
+                    b->collision = true;
+                refresh(*b, is_solid);
+                if(dy && sweep(*b, 1, dy / parts))
+                    b->collision = true;
+            }
+        }
+    }
+
+    // Runs this frame's steps, frame_time is the seconds since the last call
+    template<typename F> int update(double frame_time, F is_solid) {
+        double dt = 1.0 / COLLISION_STEP_RATE;
+        owed = std::min(owed + frame_time, MAX_COLLISION_STEPS * dt);
+        int count = 0;
+        // A little slack so frame times that add up to exactly a step are not lost to rounding
+        while(owed >= dt - 1e-9) {
+            step(dt, is_solid);
+            owed -= dt;
+            ++count;
+        }
+        return count;
+    }
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+#include "vec2.h"
+#include "tiles.cpp"
+
+using namespace std;
+
+#define COMMAND_QUEUE_SIZE 4096 // Commands that can wait for a tick at once, has to be a power of two
+
+// A fixed size ring that one thread pushes to and one thread pops from without locking
+// Each side only writes its own counter, so the other side sees a slot once the counter moves past it
+template<typename T, size_t N> class spsc_queue {
+    static_assert((N & (N - 1)) == 0, "spsc_queue size has to be a power of two");
+
+    T items[N];
+    alignas(64) atomic<size_t> head = 0; // Pushed so far, only written by the producer
+    alignas(64) atomic<size_t> tail = 0; // Popped so far, only written by the consumer
+
+    public:
+    spsc_queue() = default;
+    // Only while neither side is using either queue
+    spsc_queue &operator=(spsc_queue &&other) {
+        size_t t = other.tail.load();
+        size_t h = other.head.load();
+        for(size_t i = t;i != h;++i)
+            items[i & (N - 1)] = other.items[i & (N - 1)];
+        head = h;
+        tail = t;
+        return *this;
+    }
+
+    // Fails when the ring is full
+    bool push(const T &item) {
+        size_t h = head.load(memory_order_relaxed);
+        if(h - tail.load(memory_order_acquire) == N)
+            return false;
+        items[h & (N - 1)] = item;
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+    bool pop(T &item) {
+        size_t t = tail.load(memory_order_relaxed);
+        if(t == head.load(memory_order_acquire))
+            return false;
+        item = items[t & (N - 1)];
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head.load(memory_order_acquire) == tail.load(memory_order_acquire);
+    }
+};
+
+// A change to the world from input or gameplay, applied by the simulation between ticks in the order they were posted
+struct world_command {
+    enum kind : unsigned char {
+        SET_TILE,
+        SET_MASS, // Keeps whatever tile is there when it is applied
+        INTERACT  // Opens or closes the doors next to a door panel
+    };
+    kind type;
+    IntVec2 pos;
+    tiles::tile tile = {tiles::ID::VOID, 0}; // The new tile, or only its mass for SET_MASS
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+// Whole chunk gas diffusion kernels
+// Every kernel computes the same thing: for each of the 16x16 tiles, the mass it gains from its four neighbours,
+// where each gas to gas pair moves a fifth of their difference (rounded towards zero, so both sides agree)
+
+#define GAS_FLOW 5 // Gas tiles swap a fifth of their mass difference with each neighbour every tick (the vector kernels hard code this)
+
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define GAS_KERNEL_X86
+    #include <immintrin.h>
+#endif
+
+namespace gas_kernel {
+    // A chunk plus a one tile border on every side, indexed [x+1][y+1] like the chunk planes
+    struct halo {
+        short mass[18][18];
+        short air[18][18]; // -1 where the tile holds gas, 0 where it does not
+    };
+
+    typedef void (*kernel)(const halo &h, short flow[16][16]);
+
+    void diffuse_scalar(const halo &h, short flow[16][16]) {
+        for(int x = 1;x<17;++x) {
+            for(int y = 1;y<17;++y) {
+                int total = 0;
+                if(h.air[x][y]) {
+                    if(h.air[x+1][y])
+                        total += (h.mass[x+1][y] - h.mass[x][y]) / GAS_FLOW;
+                    if(h.air[x-1][y])
+                        total += (h.mass[x-1][y] - h.mass[x][y]) / GAS_FLOW;
+                    if(h.air[x][y+1])
+                        total += (h.mass[x][y+1] - h.mass[x][y]) / GAS_FLOW;
+                    if(h.air[x][y-1])
+                        total += (h.mass[x][y-1] - h.mass[x][y]) / GAS_FLOW;
+                }
+                flow[x-1][y-1] = total;
+            }
+        }
+    }
+
+#ifdef GAS_KERNEL_X86
+    // Signed division by 5 rounded towards zero: (d * 26215) >> 17, plus one for negative values
+    __attribute__((target("sse2")))
+    inline __m128i div5_sse2(__m128i d) {
+        __m128i q = _mm_srai_epi16(_mm_mulhi_epi16(d, _mm_set1_epi16(26215)), 1);
+        return _mm_sub_epi16(q, _mm_srai_epi16(d, 15));
+    }
+
+    __attribute__((target("sse2")))
+    void diffuse_sse2(const halo &h, short flow[16][16]) {
+        for(int x = 1;x<17;++x) {
+            // Each column of 16 tiles is two registers of 8
+            for(int y = 1;y<17;y+=8) {
+                __m128i mass = _mm_loadu_si128((const __m128i *)&h.mass[x][y]);
+                __m128i air = _mm_loadu_si128((const __m128i *)&h.air[x][y]);
+                __m128i total = _mm_setzero_si128();
+
+                const short * masses[4] = {&h.mass[x+1][y], &h.mass[x-1][y], &h.mass[x][y+1], &h.mass[x][y-1]};
+                const short * airs[4] = {&h.air[x+1][y], &h.air[x-1][y], &h.air[x][y+1], &h.air[x][y-1]};
+                for(int i = 0;i<4;++i) {
+                    __m128i n_mass = _mm_loadu_si128((const __m128i *)masses[i]);
+                    __m128i n_air = _mm_loadu_si128((const __m128i *)airs[i]);
+                    __m128i moved = div5_sse2(_mm_sub_epi16(n_mass, mass));
+                    total = _mm_add_epi16(total, _mm_and_si128(moved, _mm_and_si128(air, n_air)));
+                }
+                _mm_storeu_si128((__m128i *)&flow[x-1][y-1], total);
+            }
+        }
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i div5_avx2(__m256i d) {
+        __m256i q = _mm256_srai_epi16(_mm256_mulhi_epi16(d, _mm256_set1_epi16(26215)), 1);
+        return _mm256_sub_epi16(q, _mm256_srai_epi16(d, 15));
+    }
+
+    __attribute__((target("avx2")))
+    void diffuse_avx2(const halo &h, short flow[16][16]) {
+        // A whole column of 16 tiles fits in one register
+        for(int x = 1;x<17;++x) {
+            __m256i mass = _mm256_loadu_si256((const __m256i *)&h.mass[x][1]);
+            __m256i air = _mm256_loadu_si256((const __m256i *)&h.air[x][1]);
+            __m256i total = _mm256_setzero_si256();
+
+            const short * masses[4] = {&h.mass[x+1][1], &h.mass[x-1][1], &h.mass[x][2], &h.mass[x][0]};
+            const short * airs[4] = {&h.air[x+1][1], &h.air[x-1][1], &h.air[x][2], &h.air[x][0]};
+            for(int i = 0;i<4;++i) {
+                __m256i n_mass = _mm256_loadu_si256((const __m256i *)masses[i]);
+                __m256i n_air = _mm256_loadu_si256((const __m256i *)airs[i]);
+                __m256i moved = div5_avx2(_mm256_sub_epi16(n_mass, mass));
+                total = _mm256_add_epi16(total, _mm256_and_si256(moved, _mm256_and_si256(air, n_air)));
+            }
+            _mm256_storeu_si256((__m256i *)&flow[x-1][0], total);
+        }
+    }
+#endif
+
+    // Every kernel this CPU can run, slowest first
+    std::vector<kernel> available() {
+        std::vector<kernel> kernels = {diffuse_scalar};
+#ifdef GAS_KERNEL_X86
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("sse2"))
+            kernels.push_back(diffuse_sse2);
+        if(__builtin_cpu_supports("avx2"))
+            kernels.push_back(diffuse_avx2);
+#endif
+        return kernels;
+    }
+
+    // The fastest kernel this CPU can run
+    kernel select() {
+        return available().back();
+    }
+
+    const char * name(kernel k) {
+#ifdef GAS_KERNEL_X86
+        if(k == diffuse_avx2)
+            return "avx2";
+        if(k == diffuse_sse2)
+            return "sse2";
+#endif
+        return "scalar";
+    }
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+// The game's source only talks to raylib through this header, so the world can be built without it
+// Defining HEADLESS swaps raylib for the handful of types the world uses and drawing calls that do nothing
+#ifndef HEADLESS
+
+#include <raylib.h>
+
+#else
+
+#ifndef PI
+    #define PI 3.14159265358979323846f
+#endif
+
+struct Vector2 { float x, y; };
+struct Vector3 { float x, y, z; };
+struct Vector4 { float x, y, z, w; };
+struct Color { unsigned char r, g, b, a; };
+struct Rectangle { float x, y, width, height; };
+struct Texture2D { unsigned int id; int width, height, mipmaps, format; };
+typedef Texture2D Texture;
+struct RenderTexture2D { unsigned int id; Texture2D texture; Texture2D depth; };
+
+#define WHITE (Color){ 255, 255, 255, 255 }
+#define BLACK (Color){ 0, 0, 0, 255 }
+#define BLANK (Color){ 0, 0, 0, 0 }
+
+// Textures keep a size so layout maths still works
+inline Texture2D LoadTexture(const char *) { return (Texture2D){0, 16, 16, 1, 0}; }
+inline void UnloadTexture(Texture2D) {}
+inline RenderTexture2D LoadRenderTexture(int w, int h) { return (RenderTexture2D){0, {0, w, h, 1, 0}, {0, w, h, 1, 0}}; }
+inline void UnloadRenderTexture(RenderTexture2D) {}
+
+inline int GetRenderWidth() { return 0; }
+inline int GetRenderHeight() { return 0; }
+
+inline void BeginTextureMode(RenderTexture2D) {}
+inline void EndTextureMode() {}
+inline void ClearBackground(Color) {}
+inline void DrawTextureEx(Texture2D, Vector2, float, float, Color) {}
+inline void DrawTexturePro(Texture2D, Rectangle, Rectangle, Vector2, float, Color) {}
+inline void DrawRectangleRec(Rectangle, Color) {}
+inline void DrawText(const char *, int, int, int, Color) {}
+
+#endif
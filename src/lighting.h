@@ -0,0 +1,106 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <stdlib.h>
+
+#include "vec2.h"
+
+using namespace std;
+
+#define MAX_SHADOW 2 // Walls counted before a tile is as dark as it gets
+
+// Line of sight from one tile to everything around it, worked out once and reused until the origin moves or a wall in range changes
+// Every tile in range points at the tile one step closer to the origin along the line between them, so tiles are
+// visited nearest first and a tile's shadow is its parent's shadow plus one if the parent blocks light
+class light_map {
+    struct ray_step {
+        int dx, dy;
+        int parent; // Index of the step one tile closer to the origin
+    };
+    vector<ray_step> steps;
+    int steps_radius = -1;
+
+    // Shadow of every tile in a (2*radius + 1) square around the origin
+    vector<unsigned char> shadows;
+    vector<unsigned char> opaque;
+    IntVec2 origin = {0, 0};
+    int radius = -1;
+    unsigned long long version = 0;
+
+    void build_steps(int r) {
+        steps.clear();
+        for(int dx = -r;dx<=r;++dx) {
+            for(int dy = -r;dy<=r;++dy) {
+                if(dx*dx + dy*dy <= r*r)
+                    steps.push_back({dx, dy, 0});
+            }
+        }
+        // Rings of the same chessboard distance, so every parent comes before its children
+        stable_sort(steps.begin(), steps.end(), [](const ray_step &a, const ray_step &b) {
+            return max(abs(a.dx), abs(a.dy)) < max(abs(b.dx), abs(b.dy));
+        });
+
+        vector<int> index((2*r + 1) * (2*r + 1), -1);
+        for(size_t i = 0;i<steps.size();++i)
+            index[(steps[i].dx + r) * (2*r + 1) + steps[i].dy + r] = i;
+        for(ray_step &s : steps) {
+            int ring = max(abs(s.dx), abs(s.dy));
+            if(ring == 0)
+                continue;
+            int px = (int)lround(float(s.dx) * (ring - 1) / ring);
+            int py = (int)lround(float(s.dy) * (ring - 1) / ring);
+            s.parent = index[(px + r) * (2*r + 1) + py + r];
+        }
+        steps_radius = r;
+    }
+
+    int window_index(IntVec2 pos) const {
+        int x = pos.x - origin.x + radius;
+        int y = pos.y - origin.y + radius;
+        if(x < 0 || y < 0 || x > 2*radius || y > 2*radius)
+            return -1;
+        return x * (2*radius + 1) + y;
+    }
+
+    public:
+
+    // Recomputes only if the origin or radius moved, or a wall changed within range since the last update
+    // changes is how many times the world's walls changed so far, last_change is where the latest one was
+    template<typename F> bool update(IntVec2 new_origin, int new_radius, unsigned long long changes, IntVec2 last_change, F is_transparent) {
+        if(new_origin == origin && new_radius == radius) {
+            if(changes == version)
+                return false;
+            if(changes == version + 1 && window_index(last_change) == -1) {
+                version = changes;
+                return false;
+            }
+        }
+        origin = new_origin;
+        radius = new_radius;
+        version = changes;
+
+        if(steps_radius != radius)
+            build_steps(radius);
+        shadows.assign((2*radius + 1) * (2*radius + 1), MAX_SHADOW);
+        opaque.resize(steps.size());
+
+        for(size_t i = 0;i<steps.size();++i) {
+            const ray_step &s = steps[i];
+            opaque[i] = i != 0 && !is_transparent((IntVec2){origin.x + s.dx, origin.y + s.dy});
+            unsigned char shadow = 0;
+            if(i != 0)
+                shadow = min(MAX_SHADOW, shadows[window_index((IntVec2){origin.x + steps[s.parent].dx, origin.y + steps[s.parent].dy})] + opaque[s.parent]);
+            shadows[window_index((IntVec2){origin.x + s.dx, origin.y + s.dy})] = shadow;
+        }
+        return true;
+    }
+
+    // How many walls are between the origin and a tile, MAX_SHADOW for anything out of range
+    unsigned char shadow(IntVec2 pos) const {
+        int i = window_index(pos);
+        if(i == -1)
+            return MAX_SHADOW;
+        return shadows[i];
+    }
+};
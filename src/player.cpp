@@ -1,10 +1,11 @@
 #pragma once
 
-#include <raylib.h>
+#include "graphics.h"
 
 #include <math.h>
 
 #include "vec2.h"
+#include "collision.h"
 
 #include <iostream>
 using namespace std;
@@ -17,12 +18,11 @@ class _player {
 
     public:
 
-    // Collision detection
-    bool collision = false;
+    // Collision box in tiles, a tile wide less a fifth and centred a tile above position
+    body box;
 
     // Digging values
     bool digging = false;
-    bool interact = false;
     IntVec2 select = {0, 0};
     float dig_progress = 0; // Dig progress percentage
 
@@ -39,6 +39,15 @@ class _player {
         this->window_size = window_size;
     }
 
+    void place(Vector2 pos) {
+        position = pos;
+        box.position = {pos.x/50, pos.y/50 + 1};
+    }
+    // Moves the player to where its box was moved to
+    void follow_box() {
+        position = {box.position.x*50, (box.position.y - 1)*50};
+    }
+
     void tick_update(float dig_speed) {
         if(digging)
             dig_progress += 1.0f-dig_speed;
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <unordered_map>
+
+using namespace std;
+
+#define PROFILE_FRAMES 240 // Frames the overlay's percentiles are taken over
+#define PROFILE_TRACE_LIMIT 4000000 // Events kept in one trace before the rest are left out
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+// Times the rest of the enclosing block under a name, which has to be a string literal
+#define PROFILE_ZONE(name) profiler::scope PROFILE_CONCAT(profile_zone_, __LINE__)(name)
+
+// Wall clock timings of named zones on any thread
+// Each thread writes finished zones to its own buffer and end_frame() gathers them once a frame,
+// adding up each zone's time for the overlay and keeping every zone for a trace when one is running
+namespace profiler {
+    struct event {
+        const char * name;
+        long long start; // Nanoseconds since the profiler started
+        long long end;
+        unsigned int thread;
+        unsigned int depth;
+    };
+
+    struct thread_buffer {
+        mutex lock;
+        vector<event> events;
+        unsigned int id;
+        string name;
+        unsigned int depth = 0;
+    };
+
+    struct zone_stats {
+        string name;
+        unsigned int depth; // How deep the zone was nested the first time it was seen
+        vector<double> history = vector<double>(PROFILE_FRAMES, 0); // Milliseconds spent in the zone each frame, summed over threads
+        double p50 = 0, p90 = 0, p99 = 0, max = 0;
+    };
+
+    bool enabled = true;
+    const chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+
+    mutex registry_lock;
+    vector<unique_ptr<thread_buffer>> buffers;
+    thread_local thread_buffer * local = nullptr;
+
+    // Only touched by the thread calling end_frame()
+    vector<zone_stats> zones;
+    unordered_map<const char *, size_t> zone_index; // Names are literals, so they are looked up by address
+    unordered_map<string, size_t> zone_names; // and the same name from two places still ends up in one zone
+    size_t frame = 0;
+    bool tracing = false;
+    vector<event> trace;
+
+    long long now() {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_time).count();
+    }
+
+    thread_buffer * this_thread() {
+        if(!local) {
+            lock_guard<mutex> l(registry_lock);
+            buffers.push_back(make_unique<thread_buffer>());
+            local = buffers.back().get();
+            local->id = buffers.size();
+            local->name = "Thread " + to_string(local->id);
+        }
+        return local;
+    }
+    // Shown in traces instead of a number
+    void name_thread(const string &name) {
+        thread_buffer * buffer = this_thread();
+        lock_guard<mutex> l(buffer->lock);
+        buffer->name = name;
+    }
+
+    class scope {
+        const char * name = nullptr;
+        long long start;
+        thread_buffer * buffer;
+
+        public:
+        scope(const char * zone_name) {
+            if(!enabled)
+                return;
+            name = zone_name;
+            buffer = this_thread();
+            ++buffer->depth;
+            start = now();
+        }
+        ~scope() {
+            end();
+        }
+        // Ends the zone before the end of the block
+        void end() {
+            if(!name)
+                return;
+            long long finish = now();
+            lock_guard<mutex> l(buffer->lock);
+            buffer->events.push_back({name, start, finish, buffer->id, --buffer->depth});
+            name = nullptr;
+        }
+    };
+
+    // Gathers the zones every thread finished since the last call and moves the overlay on a frame
+    void end_frame() {
+        vector<event> events;
+        {
+            lock_guard<mutex> l(registry_lock);
+            for(auto &buffer : buffers) {
+                lock_guard<mutex> b(buffer->lock);
+                events.insert(events.end(), buffer->events.begin(), buffer->events.end());
+                buffer->events.clear();
+            }
+        }
+
+        // In the order they started on each thread, so zones are listed under the zone they are in
+        sort(events.begin(), events.end(), [](const event &a, const event &b) {
+            return a.thread != b.thread ? a.thread < b.thread : a.start < b.start;
+        });
+
+        size_t slot = frame++ % PROFILE_FRAMES;
+        for(zone_stats &zone : zones)
+            zone.history[slot] = 0;
+        for(event &e : events) {
+            auto found = zone_index.find(e.name);
+            if(found == zone_index.end()) {
+                auto named = zone_names.find(e.name);
+                if(named == zone_names.end()) {
+                    named = zone_names.insert({e.name, zones.size()}).first;
+                    zones.push_back({e.name, e.depth});
+                }
+                found = zone_index.insert({e.name, named->second}).first;
+            }
+            zones[found->second].history[slot] += (e.end - e.start) / 1e6;
+        }
+        if(tracing) {
+            size_t room = PROFILE_TRACE_LIMIT - std::min(trace.size(), (size_t)PROFILE_TRACE_LIMIT);
+            trace.insert(trace.end(), events.begin(), events.begin() + std::min(room, events.size()));
+        }
+
+        size_t frames = std::min(frame, (size_t)PROFILE_FRAMES);
+        vector<double> sorted;
+        for(zone_stats &zone : zones) {
+            sorted.assign(zone.history.begin(), zone.history.begin() + frames);
+            sort(sorted.begin(), sorted.end());
+            zone.p50 = sorted[(frames - 1) * 50 / 100];
+            zone.p90 = sorted[(frames - 1) * 90 / 100];
+            zone.p99 = sorted[(frames - 1) * 99 / 100];
+            zone.max = sorted.back();
+        }
+    }
+
+    void start_trace() {
+        trace.clear();
+        tracing = true;
+    }
+    // Writes the trace in the Chrome trace event format, which chrome://tracing and Perfetto both open
+    bool stop_trace(const string &path) {
+        tracing = false;
+        ofstream file(path, ios::trunc);
+        if(!file.is_open())
+            return false;
+        // Times are in microseconds
+        file << fixed << setprecision(3) << "{\"traceEvents\":[\n";
+        {
+            lock_guard<mutex> l(registry_lock);
+            for(auto &buffer : buffers) {
+                lock_guard<mutex> b(buffer->lock);
+                file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->id << ",\"args\":{\"name\":\"" << buffer->name << "\"}}";
+                file << (buffer != buffers.back() || !trace.empty() ? ",\n" : "\n");
+            }
+        }
+        for(size_t i = 0;i<trace.size();++i) {
+            const event &e = trace[i];
+            file << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.thread
+                 << ",\"ts\":" << e.start / 1000.0 << ",\"dur\":" << (e.end - e.start) / 1000.0 << "}"
+                 << (i + 1 < trace.size() ? ",\n" : "\n");
+        }
+        file << "]}\n";
+        trace.clear();
+        trace.shrink_to_fit();
+        return file.good();
+    }
+};
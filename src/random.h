@@ -6,19 +6,87 @@
 
 #include "../include/math+.h"
 
+// Counter based random numbers, every number is a pure function of the seed, a purpose and a few integers
+// so nothing depends on how many threads there are or what order things are generated in
 namespace Random {
     int seed = 0;
 
+    // What the numbers are for, so different systems never draw the same numbers from the same position
+    enum {
+        TERRAIN,
+        CAVE,
+        CAVE_PATH,
+        ORE,
+        ORE_MASK,
+        DEPOSIT,
+        OUTLET
+    } typedef Purpose;
+
     void init(int s) {
         seed = s;
     }
 
+    // SplitMix64 finaliser
+    inline unsigned long long mix(unsigned long long z) {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    // Stateless hash of a few integers, safe to call from any thread
+    inline unsigned long long Hash64(long long a, long long b, long long c, long long d = 0) {
+        unsigned long long h = mix((unsigned long long)seed + 0x9e3779b97f4a7c15ULL);
+        for(unsigned long long v : {a, b, c, d})
+            h = mix(h + v * 0x9e3779b97f4a7c15ULL + 0x632be59bd9b4e019ULL);
+        return h;
+    }
+    inline unsigned int Hash(long long a, long long b, long long c) {
+        unsigned long long h = Hash64(a, b, c);
+        return h ^ (h >> 32);
+    }
+
+    // A float in [0, 1) from the top 24 bits of a hash
+    inline float Float(unsigned long long h) {
+        return float(h >> 40) / float(1 << 24);
+    }
+
+    // A sequence of numbers for one purpose and key, e.g. the path of one cave
+    // Each draw hashes the key with a counter, so copies of a stream are independent and never share state
+    struct Stream {
+        unsigned long long key;
+        unsigned long long counter = 0;
+
+        Stream(Purpose purpose, long long a = 0, long long b = 0) {
+            key = Hash64(purpose, a, b, 0x5eed);
+        }
+
+        unsigned long long next() {
+            return mix(key + (++counter) * 0x9e3779b97f4a7c15ULL);
+        }
+        // [0, 1)
+        float Float() {
+            return Random::Float(next());
+        }
+        // [0, max)
+        int Int(int max) {
+            return (int)((next() >> 32) % (unsigned long long)max);
+        }
+        // [min, max)
+        int Int(int min, int max) {
+            return min + Int(max - min);
+        }
+    };
+
+    // A float in [0, 1) for a purpose at a tile position
+    inline float At(Purpose purpose, long long x, long long y, long long extra = 0) {
+        return Float(Hash64(purpose, x, y, extra));
+    }
+
     inline float Rand(long long key) {
-        srand(seed + key);
-        return float(rand())/float(RAND_MAX); 
+        return Float(Hash64(key, 0, 0, 0x7a9d));
     }
 
     inline int Int(long long key, int min, int max) { return (Rand(key)*(max-min))+min; }
     inline long Long(long long key, int min, int max) { return (Rand(key)*(max-min))+min; }
     inline double Dec(long long key, int min, int max) { return (Rand(key)*(max-min))+min; }
-};
\ No newline at end of file
+};
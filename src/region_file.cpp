@@ -0,0 +1,216 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <filesystem>
+
+// For mapping region files
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// For checking tile ids
+#include "tiles.cpp"
+
+using namespace std;
+
+#define SAVE_VERSION 1
+#define REGION_SIZE 16 // Width in chunks of the square of chunks kept in one region file
+
+// A saved world is a folder with a world file (seed and clock) and one file per region of REGION_SIZE x REGION_SIZE chunks
+// Region files start with a header and an index of where each chunk's record is, records are only read when the chunk is first used
+//
+// Chunk record:
+//   flags (1 byte), biome (2 bytes), id plane size (2 bytes)
+//   id plane, 256 bytes or run length encoded as (count - 1, id) pairs
+//   mass plane, 256 shorts
+//   adjacency, 256 bytes
+namespace region_file {
+    enum {
+        RLE_IDS = 1,
+        AWAKE = 2
+    };
+
+    struct world_header {
+        char magic[4] = {'G', 'W', 'L', 'D'};
+        unsigned short version = SAVE_VERSION;
+        unsigned short world_size = 0;
+        int seed = 0;
+        unsigned long long sim_ticks = 0;
+    };
+
+    struct index_entry {
+        unsigned int offset; // 0 if the chunk is not in the file
+        unsigned int size;
+    };
+
+    struct region_header {
+        char magic[4] = {'G', 'R', 'G', 'N'};
+        unsigned short version = SAVE_VERSION;
+        unsigned short region_size = REGION_SIZE;
+        int x = 0, y = 0;
+        index_entry index[REGION_SIZE * REGION_SIZE] = {};
+    };
+
+    // The parts of a chunk that get saved, as flat planes
+    struct chunk_data {
+        unsigned char flags = 0;
+        unsigned short biome = 0;
+        unsigned char id[256];
+        unsigned short mass[256];
+        unsigned char adjacency[256];
+    };
+
+    string region_path(const string &dir, int x, int y) {
+        return dir + "/r." + to_string(x) + "." + to_string(y) + ".region";
+    }
+    string world_path(const string &dir) {
+        return dir + "/world.dat";
+    }
+
+    template<typename T> void put(vector<unsigned char> &out, const T &value) {
+        const unsigned char * bytes = (const unsigned char *)&value;
+        out.insert(out.end(), bytes, bytes + sizeof(T));
+    }
+    template<typename T> T get(const unsigned char * &in) {
+        T value;
+        memcpy(&value, in, sizeof(T));
+        in += sizeof(T);
+        return value;
+    }
+
+    void encode(const chunk_data &c, vector<unsigned char> &out) {
+        // Most chunks are a few long runs of stone or vacuum
+        vector<unsigned char> rle;
+        for(int i = 0;i<256;) {
+            int run = 1;
+            while(i + run < 256 && run < 256 && c.id[i + run] == c.id[i])
+                ++run;
+            rle.push_back(run - 1);
+            rle.push_back(c.id[i]);
+            i += run;
+        }
+        bool use_rle = rle.size() < 256;
+
+        put<unsigned char>(out, c.flags | (use_rle ? RLE_IDS : 0));
+        put<unsigned short>(out, c.biome);
+        put<unsigned short>(out, use_rle ? rle.size() : 256);
+        if(use_rle)
+            out.insert(out.end(), rle.begin(), rle.end());
+        else
+            out.insert(out.end(), c.id, c.id + 256);
+        put(out, c.mass);
+        put(out, c.adjacency);
+    }
+
+    bool decode(const unsigned char * in, size_t size, chunk_data &c) {
+        const unsigned char * end = in + size;
+        if(size < 5)
+            return false;
+        c.flags = get<unsigned char>(in);
+        c.biome = get<unsigned short>(in);
+        unsigned short id_size = get<unsigned short>(in);
+        if(in + id_size + sizeof(c.mass) + sizeof(c.adjacency) > end)
+            return false;
+        if(c.flags & RLE_IDS) {
+            int i = 0;
+            for(int r = 0;r + 1<id_size;r+=2) {
+                int run = in[r] + 1;
+                if(i + run > 256)
+                    return false;
+                memset(c.id + i, in[r + 1], run);
+                i += run;
+            }
+            if(i != 256)
+                return false;
+        }
+        else {
+            if(id_size != 256)
+                return false;
+            memcpy(c.id, in, 256);
+        }
+        for(int i = 0;i<256;++i)
+            if(c.id[i] >= TILE_COUNT)
+                return false;
+        in += id_size;
+        memcpy(c.mass, in, sizeof(c.mass));
+        in += sizeof(c.mass);
+        memcpy(c.adjacency, in, sizeof(c.adjacency));
+        c.flags &= ~RLE_IDS;
+        return true;
+    }
+
+    // A read only view of a whole file, stays valid after the file is replaced
+    // or a writable piece of the page file
+    struct mapping {
+        const unsigned char * data = nullptr;
+        size_t size = 0;
+        unsigned int users = 0; // Chunk records in it that have not been decoded yet
+        bool pages = false;
+        size_t offset = 0;
+    };
+
+    mapping map(const string &path) {
+        mapping m;
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0)
+            return m;
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size > 0) {
+            void * data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(data != MAP_FAILED) {
+                m.data = (const unsigned char *)data;
+                m.size = st.st_size;
+            }
+        }
+        close(fd);
+        return m;
+    }
+    void unmap(mapping &m) {
+        if(m.data)
+            munmap((void *)m.data, m.size);
+        m.data = nullptr;
+        m.size = 0;
+    }
+
+    // Scratch file for chunks paged out of memory, removed straight away so it goes when the game does
+    int open_pages() {
+        string path = (filesystem::temp_directory_path() / ("game-pages-" + to_string(getpid()) + ".bin")).string();
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if(fd >= 0)
+            unlink(path.c_str());
+        return fd;
+    }
+    mapping map_pages(int fd, size_t offset, size_t size) {
+        mapping m;
+        struct stat st;
+        if(fstat(fd, &st) != 0 || ((size_t)st.st_size < offset + size && ftruncate(fd, offset + size) != 0))
+            return m;
+        void * data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+        if(data == MAP_FAILED)
+            return m;
+        m.data = (const unsigned char *)data;
+        m.size = size;
+        m.pages = true;
+        m.offset = offset;
+        return m;
+    }
+
+    // Writes next to the file and renames it over, so a crash never leaves half a file and old mappings keep their contents
+    bool write(const string &path, const vector<unsigned char> &bytes) {
+        string tmp = path + ".tmp";
+        {
+            ofstream file(tmp, ios::binary | ios::trunc);
+            if(!file.is_open())
+                return false;
+            file.write((const char *)bytes.data(), bytes.size());
+            if(!file.good())
+                return false;
+        }
+        return rename(tmp.c_str(), path.c_str()) == 0;
+    }
+};
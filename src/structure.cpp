@@ -0,0 +1,239 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <unordered_map>
+#include <filesystem>
+#include <algorithm>
+
+#include "vec2.h"
+#include "tiles.cpp"
+#include "region_file.cpp"
+
+using namespace std;
+
+#define STRUCTURE_VERSION 1
+
+// A prefab of tiles stamped into the world, kept as the runs of non void tiles up each column
+// since that is how chunk planes are laid out, so each run goes into a chunk with one copy
+struct Structure {
+    string src;
+    int width = 0, height = 0;
+
+    struct span {
+        unsigned short x, y, length;
+        unsigned int offset; // Where its tiles start in ids and mass
+    };
+    vector<span> spans;
+    vector<unsigned char> ids;
+    vector<unsigned short> mass; // Packed starting mass of each tile in ids
+
+    // Calls fn(chunk position, position in the chunk, length, ids, mass) for each part of a span that is in one chunk,
+    // with the structure's bottom left at pos and only the tiles from min up to but not including max
+    template<typename F> void pieces(IntVec2 pos, IntVec2 min, IntVec2 max, F fn) const {
+        for(const span &s : spans) {
+            int x = pos.x + s.x;
+            if(x < min.x || x >= max.x)
+                continue;
+            int start = std::max(pos.y + s.y, min.y);
+            int end = std::min(pos.y + s.y + s.length, max.y);
+            while(start < end) {
+                int stop = std::min(end, (start/16 + 1)*16);
+                size_t i = s.offset + (start - pos.y - s.y);
+                fn(
+                    (UShortVec2){(unsigned short)(x/16), (unsigned short)(start/16)},
+                    (UShortVec2){(unsigned short)(x%16), (unsigned short)(start%16)},
+                    stop - start, &ids[i], &mass[i]
+                );
+                start = stop;
+            }
+        }
+    }
+};
+
+// .struct files are text from map-editor.py, one digit per tile offset from '0' with the top row first
+// They get compiled into a binary file next to them, which is used instead until the text is changed
+//
+// Compiled structure:
+//   header, then span_count spans of x, y, length (3 unsigned shorts each), then the ids of every span one after another
+namespace structure_file {
+    struct header {
+        char magic[4] = {'G', 'S', 'T', 'R'};
+        unsigned int span_count = 0;
+        unsigned short version = STRUCTURE_VERSION;
+        unsigned short width = 0, height = 0;
+        unsigned short reserved = 0;
+    };
+
+    string compiled_path(const string &path) {
+        return path + ".bin";
+    }
+
+    // Splits a grid of ids (x major, bottom row first) into spans
+    void build(Structure &s, const vector<unsigned char> &grid) {
+        s.spans.clear();
+        s.ids.clear();
+        for(int x = 0;x<s.width;++x) {
+            for(int y = 0;y<s.height;) {
+                if(!grid[x*s.height + y]) {
+                    ++y;
+                    continue;
+                }
+                Structure::span span = {(unsigned short)x, (unsigned short)y, 0, (unsigned int)s.ids.size()};
+                while(y < s.height && grid[x*s.height + y]) {
+                    s.ids.push_back(grid[x*s.height + y]);
+                    ++span.length;
+                    ++y;
+                }
+                s.spans.push_back(span);
+            }
+        }
+        s.mass.resize(s.ids.size());
+        for(size_t i = 0;i<s.ids.size();++i)
+            s.mass[i] = tiles::pack_mass(tiles::tile_prefabs[s.ids[i]].mass);
+    }
+
+    bool parse_text(const string &text, Structure &s) {
+        vector<string> lines;
+        size_t start = 0;
+        while(start <= text.size()) {
+            size_t end = text.find('\n', start);
+            if(end == string::npos)
+                end = text.size();
+            string line = text.substr(start, end - start);
+            if(!line.empty() && line.back() == '\r')
+                line.pop_back();
+            lines.push_back(line);
+            start = end + 1;
+        }
+        while(!lines.empty() && lines.back().empty())
+            lines.pop_back();
+        if(lines.empty() || lines.size() > 65535)
+            return false;
+
+        // Short lines are padded out with void
+        s.height = lines.size();
+        s.width = 0;
+        for(string &line : lines)
+            s.width = std::max(s.width, (int)line.size());
+        if(s.width > 65535)
+            return false;
+        vector<unsigned char> grid(s.width * s.height, tiles::ID::VOID);
+        for(int y = 0;y<s.height;++y) {
+            const string &line = lines[s.height - y - 1];
+            for(size_t x = 0;x<line.size();++x) {
+                int id = line[x] - '0';
+                if(id < 0 || id >= TILE_COUNT)
+                    return false;
+                grid[x*s.height + y] = id;
+            }
+        }
+        build(s, grid);
+        return true;
+    }
+
+    void encode(const Structure &s, vector<unsigned char> &out) {
+        header h;
+        h.width = s.width;
+        h.height = s.height;
+        h.span_count = s.spans.size();
+        region_file::put(out, h);
+        for(const Structure::span &span : s.spans) {
+            region_file::put(out, span.x);
+            region_file::put(out, span.y);
+            region_file::put(out, span.length);
+        }
+        out.insert(out.end(), s.ids.begin(), s.ids.end());
+    }
+
+    bool decode(const unsigned char * in, size_t size, Structure &s) {
+        const unsigned char * end = in + size;
+        if(size < sizeof(header))
+            return false;
+        header h = region_file::get<header>(in);
+        if(memcmp(h.magic, header().magic, 4) != 0 || h.version != STRUCTURE_VERSION)
+            return false;
+        if((size_t)(end - in) < (size_t)h.span_count * 6)
+            return false;
+        s.width = h.width;
+        s.height = h.height;
+        s.spans.resize(h.span_count);
+        size_t total = 0;
+        for(Structure::span &span : s.spans) {
+            span.x = region_file::get<unsigned short>(in);
+            span.y = region_file::get<unsigned short>(in);
+            span.length = region_file::get<unsigned short>(in);
+            span.offset = total;
+            total += span.length;
+            if(span.x >= s.width || span.y + span.length > s.height)
+                return false;
+        }
+        if((size_t)(end - in) != total)
+            return false;
+        s.ids.assign(in, end);
+        s.mass.resize(total);
+        for(size_t i = 0;i<total;++i) {
+            if(s.ids[i] >= TILE_COUNT)
+                return false;
+            s.mass[i] = tiles::pack_mass(tiles::tile_prefabs[s.ids[i]].mass);
+        }
+        return true;
+    }
+
+    bool read(const string &path, vector<unsigned char> &bytes) {
+        ifstream file(path, ios::binary);
+        if(!file.is_open())
+            return false;
+        bytes.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        return true;
+    }
+
+    // Reads a compiled file, or text which is compiled and written out for next time
+    bool load(const string &path, Structure &s) {
+        vector<unsigned char> bytes;
+        if(!read(path, bytes))
+            return false;
+        if(bytes.size() >= 4 && memcmp(bytes.data(), header().magic, 4) == 0)
+            return decode(bytes.data(), bytes.size(), s);
+
+        string compiled = compiled_path(path);
+        error_code error;
+        if(filesystem::exists(compiled, error) && filesystem::last_write_time(compiled, error) >= filesystem::last_write_time(path, error)) {
+            vector<unsigned char> cached;
+            if(read(compiled, cached) && decode(cached.data(), cached.size(), s))
+                return true;
+        }
+
+        if(!parse_text(string(bytes.begin(), bytes.end()), s))
+            return false;
+        // Not being able to write it out only means it is compiled again next time
+        vector<unsigned char> out;
+        encode(s, out);
+        region_file::write(compiled, out);
+        return true;
+    }
+};
+
+// Structures are only loaded once however many times they are asked for, from the main thread
+unordered_map<string, unique_ptr<Structure>> structure_cache;
+
+const Structure &LoadStructure(const string &filename) {
+    auto found = structure_cache.find(filename);
+    if(found != structure_cache.end())
+        return *found->second;
+
+    unique_ptr<Structure> s = make_unique<Structure>();
+    s->src = filename;
+    if(structure_file::load(filename, *s))
+        cout << "Loaded structure (" << s->width << "x" << s->height << ")\n";
+    else {
+        cout << "Could not load structure " << filename << "\n";
+        *s = Structure();
+        s->src = filename;
+    }
+    return *(structure_cache[filename] = move(s));
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <algorithm>
+
+#include "profiler.h"
+
+using namespace std;
+
+// A set of worker threads that stay alive between jobs
+// Work is handed out in batches from a shared counter, so a worker that finishes early just takes the next batch
+class thread_pool {
+    vector<thread> workers;
+
+    mutex lock;
+    condition_variable wake;
+    condition_variable finished;
+
+    // The current job
+    function<void(size_t)> job;
+    size_t job_count = 0;
+    size_t batch = 1;
+    atomic<size_t> next = 0;
+
+    size_t running = 0; // Workers that have not finished the current job yet
+    unsigned long long generation = 0;
+    bool stopping = false;
+
+    void run_batches() {
+        size_t start;
+        while((start = next.fetch_add(batch)) < job_count) {
+            size_t end = min(start + batch, job_count);
+            for(size_t i = start;i<end;++i)
+                job(i);
+        }
+    }
+
+    // Starts out having seen the jobs dispatched before it was made, so it only wakes for new ones
+    void work(unsigned long long seen) {
+        profiler::name_thread("Worker");
+        while(true) {
+            {
+                unique_lock<mutex> l(lock);
+                wake.wait(l, [this, seen] { return stopping || generation != seen; });
+                if(stopping)
+                    return;
+                seen = generation;
+            }
+
+            run_batches();
+
+            lock_guard<mutex> l(lock);
+            if(--running == 0)
+                finished.notify_all();
+        }
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> l(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(thread &t : workers)
+            t.join();
+        workers.clear();
+        stopping = false;
+    }
+
+    public:
+
+    // 0 threads uses one per core
+    thread_pool(unsigned int count = 0) {
+        resize(count);
+    }
+    ~thread_pool() {
+        wait();
+        stop();
+    }
+
+    void resize(unsigned int count) {
+        if(count == 0)
+            count = max(1u, thread::hardware_concurrency());
+        wait();
+        stop();
+        lock_guard<mutex> l(lock);
+        for(unsigned int i = 0;i<count;++i)
+            workers.push_back(thread(&thread_pool::work, this, generation));
+    }
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    // Starts running fn(0) to fn(count-1) on the workers and returns straight away
+    void dispatch(size_t count, function<void(size_t)> fn, size_t batch_size = 1) {
+        wait();
+        {
+            lock_guard<mutex> l(lock);
+            job = fn;
+            job_count = count;
+            batch = max((size_t)1, batch_size);
+            next = 0;
+            running = workers.size();
+            ++generation;
+        }
+        wake.notify_all();
+    }
+
+    // Blocks until the last dispatched job is done
+    void wait() {
+        unique_lock<mutex> l(lock);
+        finished.wait(l, [this] { return running == 0; });
+    }
+
+    void run(size_t count, function<void(size_t)> fn, size_t batch_size = 1) {
+        dispatch(count, fn, batch_size);
+        wait();
+    }
+};
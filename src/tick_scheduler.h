@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <algorithm>
+
+#define DEFAULT_TPS 10
+#define MIN_TPS 1
+#define MAX_TPS 240
+#define MAX_TICKS_PER_FRAME 4  // Ticks one frame runs to catch up before leaving the rest for the next frames
+#define MAX_BACKLOG_TICKS 20   // Ticks owed past this are dropped, so a long stall does not turn into a burst of ticks
+#define FAST_FORWARD_BUDGET 25 // Milliseconds of each frame spent ticking while fast forwarding
+
+// Runs the simulation at a fixed number of ticks a second whatever the frame rate is
+// Frame times are added up and paid out as whole ticks, so a slow frame's ticks are run on the frames after it
+// Fast forwarding ignores the clock and runs ticks back to back for most of each frame
+struct tick_scheduler {
+    double tps = DEFAULT_TPS;
+    bool fast_forward = false;
+
+    unsigned long long ticks = 0; // Ticks run since the game started
+    unsigned long long dropped = 0; // Ticks given up on for being too far behind
+    int frame_ticks = 0; // Ticks run in the last frame
+    double tick_ms = 0; // Average time a tick took
+    double owed = 0; // Seconds of ticks not run yet
+
+    void set_tps(double value) {
+        tps = std::clamp(value, (double)MIN_TPS, (double)MAX_TPS);
+    }
+
+    // How many ticks the simulation is behind real time
+    double lag() const {
+        return fast_forward ? 0 : owed * tps;
+    }
+
+    // Runs this frame's ticks, frame_time is the seconds since the last call
+    template<typename F> int update(double frame_time, F tick) {
+        auto start = std::chrono::steady_clock::now();
+        auto elapsed_ms = [&start]() {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        };
+
+        frame_ticks = 0;
+        if(fast_forward) {
+            owed = 0;
+            do {
+                tick();
+                ++frame_ticks;
+            } while(elapsed_ms() < FAST_FORWARD_BUDGET);
+        }
+        else {
+            double step = 1.0 / tps;
+            owed += frame_time;
+            // A little slack so frame times that add up to exactly a tick are not lost to rounding
+            while(owed >= step - 1e-9 && frame_ticks < MAX_TICKS_PER_FRAME) {
+                tick();
+                owed -= step;
+                ++frame_ticks;
+            }
+            if(owed > MAX_BACKLOG_TICKS * step) {
+                dropped += (unsigned long long)((owed - MAX_BACKLOG_TICKS * step) / step);
+                owed = MAX_BACKLOG_TICKS * step;
+            }
+        }
+
+        ticks += frame_ticks;
+        if(frame_ticks)
+            tick_ms = (tick_ms*10 + elapsed_ms() / frame_ticks) / 11;
+        return frame_ticks;
+    }
+};
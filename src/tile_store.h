@@ -0,0 +1,317 @@
+#pragma once
+
+#include <memory>
+#include <cstring>
+#include <algorithm>
+
+#include "tiles.cpp"
+
+using namespace std;
+
+// A chunk's tiles as separate id and fixed point mass planes
+struct tile_planes {
+    unsigned char id[16][16];
+    unsigned short mass[16][16];
+};
+
+// A chunk's tiles in the smallest of three forms, since most chunks are solid stone or a few kinds of rock
+//   UNIFORM  every tile is the same one, kept inline
+//   PALETTE  up to 16 different tiles, with a 2 bit (up to 4 kinds) or 4 bit index per tile
+//   FULL     the planes
+// Writes move it up to a bigger form when they have to, compact() moves it back down
+class tile_store {
+    public:
+    enum form : unsigned char {
+        UNIFORM,
+        PALETTE,
+        FULL
+    };
+
+    tile_store() = default;
+    tile_store(const tile_store &other) {
+        *this = other;
+    }
+    tile_store &operator=(const tile_store &other) {
+        if(this == &other)
+            return *this;
+        kind = other.kind;
+        bits = other.bits;
+        palette_size = other.palette_size;
+        uniform = other.uniform;
+        data.reset();
+        if(other.data) {
+            data = make_unique<unsigned char[]>(other.block_size());
+            memcpy(data.get(), other.data.get(), other.block_size());
+        }
+        return *this;
+    }
+
+    form get_form() const {
+        return kind;
+    }
+    bool is_full() const {
+        return kind == FULL;
+    }
+
+    tiles::packed_tile get(int x, int y) const {
+        switch(kind) {
+            case UNIFORM:
+                return uniform;
+            case PALETTE:
+                return palette()[index(x, y)];
+            default:
+                return {full()->id[x][y], full()->mass[x][y]};
+        }
+    }
+    unsigned char id(int x, int y) const {
+        return kind == FULL ? full()->id[x][y] : get(x, y).id;
+    }
+
+    void set(int x, int y, tiles::packed_tile t) {
+        if(kind == UNIFORM) {
+            if(same(t, uniform))
+                return;
+            to_palette(2);
+        }
+        if(kind == PALETTE) {
+            int i = find(t);
+            if(i < 0 && palette_size < (1 << bits)) {
+                i = palette_size++;
+                palette()[i] = t;
+            }
+            if(i < 0 && bits == 2) {
+                to_palette(4);
+                i = palette_size++;
+                palette()[i] = t;
+            }
+            if(i >= 0) {
+                set_index(x, y, i);
+                return;
+            }
+            to_full();
+        }
+        full()->id[x][y] = t.id;
+        full()->mass[x][y] = t.mass;
+    }
+
+    // The planes to write to directly, moving up to the full form first
+    tile_planes &planes() {
+        to_full();
+        return *full();
+    }
+    void assign(const tile_planes &p) {
+        to_full();
+        *full() = p;
+    }
+    void copy_to(tile_planes &out) const {
+        if(kind == FULL) {
+            out = *full();
+            return;
+        }
+        if(kind == UNIFORM) {
+            memset(out.id, uniform.id, sizeof(out.id));
+            fill(&out.mass[0][0], &out.mass[0][0] + 256, uniform.mass);
+            return;
+        }
+        const tiles::packed_tile * p = palette();
+        const unsigned char * in = indices();
+        int per_byte = 8 / bits;
+        int mask = (1 << bits) - 1;
+        for(int i = 0;i<256;++i) {
+            tiles::packed_tile t = p[(in[i / per_byte] >> ((i % per_byte) * bits)) & mask];
+            out.id[i / 16][i % 16] = t.id;
+            out.mass[i / 16][i % 16] = t.mass;
+        }
+    }
+
+    // Moves down to the smallest form that holds the tiles
+    void compact() {
+        if(kind == UNIFORM)
+            return;
+        tile_planes planes;
+        copy_to(planes);
+
+        // Tiles mostly come in runs, so the last one found is checked first
+        tiles::packed_tile found[16];
+        unsigned char which[256];
+        int count = 0;
+        int last = 0;
+        for(int i = 0;i<256 && count <= 16;++i) {
+            tiles::packed_tile t = {planes.id[i / 16][i % 16], planes.mass[i / 16][i % 16]};
+            if(!count || !same(found[last], t)) {
+                last = 0;
+                while(last < count && !same(found[last], t))
+                    ++last;
+                if(last == count) {
+                    if(count == 16) {
+                        count = 17;
+                        break;
+                    }
+                    found[count++] = t;
+                }
+            }
+            which[i] = last;
+        }
+        if(count > 16 || (kind == PALETTE && count == palette_size && bits == (count <= 4 ? 2 : 4)))
+            return;
+        if(count == 1) {
+            uniform = found[0];
+            kind = UNIFORM;
+            data.reset();
+            return;
+        }
+
+        tile_store packed;
+        packed.kind = PALETTE;
+        packed.bits = count <= 4 ? 2 : 4;
+        packed.palette_size = count;
+        packed.data = make_unique<unsigned char[]>(packed.block_size());
+        memcpy(packed.palette(), found, count * sizeof(tiles::packed_tile));
+        memset(packed.indices(), 0, 256 * packed.bits / 8);
+        for(int i = 0;i<256;++i)
+            packed.set_index(i / 16, i % 16, which[i]);
+        *this = std::move(packed);
+    }
+
+    size_t heap_bytes() const {
+        return data ? block_size() : 0;
+    }
+
+    tile_store(tile_store &&) = default;
+    tile_store &operator=(tile_store &&) = default;
+
+    private:
+    form kind = UNIFORM;
+    unsigned char bits = 0; // Bits per index in the palette form
+    unsigned char palette_size = 0;
+    tiles::packed_tile uniform = {0, 0};
+    unique_ptr<unsigned char[]> data; // The palette then the indices, or the planes
+
+    static bool same(tiles::packed_tile a, tiles::packed_tile b) {
+        return a.id == b.id && a.mass == b.mass;
+    }
+
+    size_t block_size() const {
+        if(kind == FULL)
+            return sizeof(tile_planes);
+        return (1 << bits) * sizeof(tiles::packed_tile) + 256 * bits / 8;
+    }
+    tile_planes * full() const {
+        return (tile_planes *)data.get();
+    }
+    tiles::packed_tile * palette() const {
+        return (tiles::packed_tile *)data.get();
+    }
+    unsigned char * indices() const {
+        return data.get() + (1 << bits) * sizeof(tiles::packed_tile);
+    }
+
+    int index(int x, int y) const {
+        int i = x*16 + y;
+        int per_byte = 8 / bits;
+        return (indices()[i / per_byte] >> ((i % per_byte) * bits)) & ((1 << bits) - 1);
+    }
+    void set_index(int x, int y, int value) {
+        int i = x*16 + y;
+        int per_byte = 8 / bits;
+        int shift = (i % per_byte) * bits;
+        unsigned char &b = indices()[i / per_byte];
+        b = (b & ~(((1 << bits) - 1) << shift)) | (value << shift);
+    }
+    int find(tiles::packed_tile t) const {
+        for(int i = 0;i<palette_size;++i)
+            if(same(palette()[i], t))
+                return i;
+        return -1;
+    }
+
+    // Re-encodes whatever is stored as a palette with the given bits per index
+    void to_palette(int new_bits) {
+        tile_store grown;
+        grown.kind = PALETTE;
+        grown.bits = new_bits;
+        grown.data = make_unique<unsigned char[]>(grown.block_size());
+        memset(grown.data.get(), 0, grown.block_size());
+        if(kind == UNIFORM) {
+            grown.palette_size = 1;
+            grown.palette()[0] = uniform;
+        }
+        else {
+            grown.palette_size = palette_size;
+            memcpy(grown.palette(), palette(), palette_size * sizeof(tiles::packed_tile));
+            for(int x = 0;x<16;++x)
+                for(int y = 0;y<16;++y)
+                    grown.set_index(x, y, index(x, y));
+        }
+        *this = std::move(grown);
+    }
+    void to_full() {
+        if(kind == FULL)
+            return;
+        unique_ptr<unsigned char[]> planes = make_unique<unsigned char[]>(sizeof(tile_planes));
+        copy_to(*(tile_planes *)planes.get());
+        data = std::move(planes);
+        kind = FULL;
+    }
+};
+
+// A chunk's shading masks, kept as one byte while they are all the same
+class mask_store {
+    public:
+    mask_store() = default;
+    mask_store(const mask_store &other) {
+        *this = other;
+    }
+    mask_store &operator=(const mask_store &other) {
+        if(this == &other)
+            return *this;
+        uniform = other.uniform;
+        data.reset();
+        if(other.data) {
+            data = make_unique<unsigned char[]>(256);
+            memcpy(data.get(), other.data.get(), 256);
+        }
+        return *this;
+    }
+
+    unsigned char get(int x, int y) const {
+        return data ? data[x*16 + y] : uniform;
+    }
+    void set(int x, int y, unsigned char value) {
+        if(!data) {
+            if(value == uniform)
+                return;
+            data = make_unique<unsigned char[]>(256);
+            memset(data.get(), uniform, 256);
+        }
+        data[x*16 + y] = value;
+    }
+    void assign(const unsigned char masks[16][16]) {
+        if(!data)
+            data = make_unique<unsigned char[]>(256);
+        memcpy(data.get(), masks, 256);
+    }
+    void copy_to(unsigned char masks[16][16]) const {
+        if(data)
+            memcpy(masks, data.get(), 256);
+        else
+            memset(masks, uniform, 256);
+    }
+    void compact() {
+        if(!data)
+            return;
+        for(int i = 1;i<256;++i)
+            if(data[i] != data[0])
+                return;
+        uniform = data[0];
+        data.reset();
+    }
+
+    size_t heap_bytes() const {
+        return data ? 256 : 0;
+    }
+
+    private:
+    unsigned char uniform = 0;
+    unique_ptr<unsigned char[]> data;
+};
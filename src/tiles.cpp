@@ -1,12 +1,13 @@
 #pragma once
 
 // Raylib headers
-#include <raylib.h>
+#include "graphics.h"
 
 #include "player.cpp"
 
 // C++ headers
 #include <iostream>
+#include <vector>
 #include <math.h>
 
 #include "vec2.h"
@@ -19,6 +20,9 @@ using namespace std;
 
 #define TILE_COUNT 14
 
+#define MASS_SCALE 16  // Stored masses are fixed point in 1/16ths
+#define MAX_MASS 32767 // Largest stored mass (about 2048), keeps differences inside a signed short
+
 namespace tiles {
     enum {
         VOID,
@@ -79,6 +83,12 @@ namespace tiles {
         float mass = 1500;
     };
 
+    // How a tile is stored inside a chunk
+    struct packed_tile {
+        unsigned char id;
+        unsigned short mass;
+    };
+
     struct data_tile {
     };
 
@@ -120,6 +130,13 @@ namespace tiles {
         return (tile){id, tile_prefabs[id].mass};
     }
 
+    inline static unsigned short pack_mass(float mass) {
+        return clamp(round(mass * MASS_SCALE), 0, MAX_MASS);
+    }
+    inline static float unpack_mass(unsigned short mass) {
+        return float(mass) / MASS_SCALE;
+    }
+
     inline static bool is_air(unsigned short id) {
         return tile_prefabs[id].gas;
     }
@@ -132,6 +149,10 @@ namespace tiles {
     inline static bool is_collidable(unsigned short id) {
         return tile_prefabs[id].can_collide && !is_air(id);
     }
+    // Tiles the simulation has to look at every tick
+    inline static bool is_simulated(unsigned short id) {
+        return is_air(id) || id == ID::GAS_OUTLET || id == ID::DOOR_OPEN;
+    }
 
     inline static bool has_wire_input(unsigned short id) {
         return id == ID::DOOR;
@@ -140,27 +161,48 @@ namespace tiles {
         return id == ID::DOOR_PANEL_A || ID::DOOR_PANEL_B;
     }
 
-    void draw_tile(tile tile, Vector2 pos, float scale, Color tint, int *wall, short next_to, bool selected, tiles::tile gas = tiles::VOID_TILE) {
+    // Gas tint and wall shading are queued while the tiles are drawn and then drawn into the shading buffer in one go,
+    // instead of switching render targets for every tile
+    struct overlay_quad {
+        Texture2D texture;
+        Rectangle dest;
+        Vector2 origin;
+        float rotation;
+        Color tint;
+    };
+    vector<overlay_quad> overlays;
+
+    void queue_overlay(Texture2D texture, Rectangle dest, Vector2 origin, float rotation, Color tint) {
+        overlays.push_back({texture, dest, origin, rotation, tint});
+    }
+
+    // Redraws the shading buffer from this frame's queued overlays
+    void flush_overlays() {
+        BeginTextureMode(shading_buffer);
+        ClearBackground((Color){0, 0, 0, 0});
+        for(overlay_quad &q : overlays)
+            DrawTexturePro(q.texture, {0, 0, (float)shade.width, (float)shade.height}, q.dest, q.origin, q.rotation, q.tint);
+        EndTextureMode();
+        overlays.clear();
+    }
+
+    // The tile itself, which is the part that gets baked into the chunk cache
+    void draw_base(tile tile, Vector2 screen_pos, float scale, Color tint) {
         if(tile.id == ID::VOID)
             return;
 
-        if(selected)
-            tint = WHITE;
-
         // Draw the ground behind transparent tiles
         if(is_transparent(tile.id))
-            DrawTextureEx(sprites[ID::VACUMN], {
-                GetRenderWidth()/2.0f + pos.x, 
-                GetRenderHeight()/2.0f - pos.y
-            }, 0, scale+0.01f // A bit larger to avoid any gaps
-            , tint);
+            DrawTextureEx(sprites[ID::VACUMN], screen_pos, 0, scale, tint);
 
         // Draw the tile
-        DrawTextureEx(sprites[tile.id], {
-            GetRenderWidth()/2.0f + pos.x, 
-            GetRenderHeight()/2.0f - pos.y
-        }, 0, scale+0.01f // A bit larger to avoid any gaps
-        , tint);
+        DrawTextureEx(sprites[tile.id], screen_pos, 0, scale, tint);
+    }
+
+    // Everything drawn over a tile that can change from frame to frame
+    void draw_overlays(tile tile, Vector2 pos, float scale, int *wall, short next_to, bool selected, tiles::tile gas = tiles::VOID_TILE) {
+        if(tile.id == ID::VOID)
+            return;
 
         // Check if the tile is selected
         if(selected) {
@@ -170,26 +212,21 @@ namespace tiles {
                     GetRenderWidth()/2.0f + pos.x, 
                     GetRenderHeight()/2.0f - pos.y
                 }, 0, scale*2+0.01f // A bit larger to avoid any gaps
-                , tint);
+                , WHITE);
             // Draw the selection overlay
             else
                 DrawTextureEx(dig_sprites[ (int)(player->dig_progress*29) ], {
                     GetRenderWidth()/2.0f + pos.x, 
                     GetRenderHeight()/2.0f - pos.y
                 }, 0, scale*2+0.01f // A bit larger to avoid any gaps
-                , tint);
+                , WHITE);
         }
 
         // Non airtight overlay
-        if(is_not_airtight(tile.id) && gas.id != 0) {
+        if(is_not_airtight(tile.id) && gas.id == ID::OXYGEN) {
             // Overlay the gas texture
-            Texture2D gas_texture;
-            if(gas.id == ID::OXYGEN)
-                gas_texture = oxygen;
-            BeginTextureMode(shading_buffer);
-            DrawTexturePro(
-                gas_texture,
-                {0, 0, (float)shade.width, (float)shade.height},
+            queue_overlay(
+                oxygen,
                 {
                     GetRenderWidth()/2.0f + pos.x+ 8*scale, 
                     GetRenderHeight()/2.0f + pos.y - 8*scale,
@@ -200,17 +237,14 @@ namespace tiles {
                 0,
                 (Color){255, 255, 255, (unsigned char)clamp(gas.mass / 9.5f, 0, 200)}
             );
-            EndTextureMode();
         }
 
         // Shading and tint
         if(is_air(tile.id)) {
             // Overlay the gas texture
-            BeginTextureMode(shading_buffer);
             if(tile.id == ID::OXYGEN) {
-                DrawTexturePro(
+                queue_overlay(
                     oxygen,
-                    {0, 0, (float)shade.width, (float)shade.height},
                     {
                         GetRenderWidth()/2.0f + pos.x+ 8*scale, 
                         GetRenderHeight()/2.0f + pos.y - 8*scale,
@@ -224,11 +258,9 @@ namespace tiles {
             }
             
             // Wall shading
-            if (next_to) {
-                for(int i = 0;i<next_to;++i)
-                    DrawTexturePro(
+            for(int i = 0;i<next_to;++i)
+                queue_overlay(
                     tile.id == ID::OXYGEN && tile.mass > 1100 ? gas_shade : shade,
-                    {0, 0, (float)shade.width, (float)shade.height},
                     {
                         GetRenderWidth()/2.0f + pos.x+ 8*scale, 
                         GetRenderHeight()/2.0f + pos.y - 8*scale,
@@ -238,9 +270,19 @@ namespace tiles {
                     { 8*scale, 8*scale },
                     wall[i],
                     (Color){255, 255, 255, (unsigned char)(150)}
-                    );
-            }
-            EndTextureMode();
+                );
         }
     }
+
+    void draw_tile(tile tile, Vector2 pos, float scale, Color tint, int *wall, short next_to, bool selected, tiles::tile gas = tiles::VOID_TILE) {
+        if(selected)
+            tint = WHITE;
+
+        draw_base(tile, {
+            GetRenderWidth()/2.0f + pos.x, 
+            GetRenderHeight()/2.0f - pos.y
+        }, scale+0.01f // A bit larger to avoid any gaps
+        , tint);
+        draw_overlays(tile, pos, scale, wall, next_to, selected, gas);
+    }
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #pragma once
 
-#include <raylib.h>
+#include "graphics.h"
+
+#include <math.h>
 
 // Vector2 with integer values
 struct IntVec2 {
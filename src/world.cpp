@@ -1,12 +1,20 @@
-#include <raylib.h>
+#include "graphics.h"
 
-#include <map>
 #include <vector>
+#include <memory>
 #include <iostream>
 #include <fstream>
 #include <algorithm>
 #include <cctype>
-#include <thread>
+#include <array>
+#include <unordered_map>
+
+// For the simulation workers
+#include "thread_pool.h"
+#include "gas_kernel.h"
+
+// For timing frames and ticks
+#include "profiler.h"
 
 // For big vector2
 #include "vec2.h"
@@ -14,11 +22,34 @@
 // For better map size output
 #include "byte_util.h"
 
+// For line of sight
+#include "lighting.h"
+
+// For saving and loading
+#include "region_file.cpp"
+#include <filesystem>
+#include <chrono>
+
+// For baked chunk textures
+#include "chunk_cache.cpp"
+
 // For tile operations
 #include "tiles.cpp"
 #include "player.cpp"
 #include "random.h"
 
+// For prefabs
+#include "structure.cpp"
+
+// For compact chunks
+#include "tile_store.h"
+
+// For edits from the game
+#include "command_queue.h"
+
+// For world generation
+#include "carve.h"
+
 #define CAVE_COUNT 100
 #define MAX_CAVE_LEN 12
 #define MIN_CAVE_LEN  4
@@ -28,10 +59,29 @@
 #define ORES 1000
 #define DEPOSITS 500
 
+#define GEN_REGION 4 // Width in chunks of the square of chunks one worker fills during generation
+#define TERRAIN_VIEWS 16 // Width in chunks of the window of unstored chunks that can be looked at at once
+#define NO_VIEW ((UShortVec2){65535, 65535})
+
+#define PAGE_BUDGET (64 << 20) // Bytes of chunks kept in memory before the ones furthest from use are paged out, 0 to never page
+#define PAGE_KEEP_RADIUS 4 // Chunks this close to the player always stay in memory
+#define PAGE_SEGMENT (4 << 20) // The page file is mapped in pieces this big
+#define PAGE_CHECK_TICKS 16 // How often the chunks in memory are checked against the budget
+
+#define OUTLET_FLOW 10
+
+#define SIM_THREADS 0 // Simulation worker threads, 0 uses one per core
+#define SIM_BATCH 4   // Chunks a worker takes at a time
+#define SLEEP_TICKS 5 // Ticks without change before a chunk stops being simulated
+
 #define DARKNESS 50
 #define LIMIT_LIGHTING true
+#define UNLIMITED_LIGHT_DIST 64 // How far light reaches when LIMIT_LIGHTING is off
 
-#define WORLD_SIZE 500 // Max of 4000
+#ifndef WORLD_SIZE
+    #define WORLD_SIZE 500 // Max of 4000
+#endif
+#define CHUNK_COUNT (WORLD_SIZE/16 + 1) // Chunks along each side of the world
 
 unsigned short max_light_dist = 15;
 
@@ -45,66 +95,373 @@ struct wire {
 };
 
 struct chunk {
-    tiles::tile content[16][16];
+    tile_store store;
     unsigned short biome;
-    const tiles::tile * operator []( const short x ) const {
-        return content[x];
-    }
-}null_chunk;
+    UShortVec2 position;
+    unsigned int revision = 0; // Bumped whenever the chunk would look different without its overlays
 
-struct tile_column {
-    unsigned short *column;
-};
+    // For the shading overlays, one bit per collidable neighbour in the simulation's neighbour order,
+    // and the top bits hold which neighbour (counting from 1) is the first one holding gas
+    mask_store adjacency;
+
+    bool dirty = true; // Changed since it was last saved
+    unsigned long long last_used = 0; // The last tick it was drawn or simulated, for paging
 
-struct Structure {
-    string src;
-    int width, height;
-    tile_column * content; // This data is definitly not readable, the string is just to make usage easier
+    // Simulation state
+    bool awake = false;
+    unsigned char idle_ticks = 0;
+    unsigned long long scheduled = 0; // The last tick this chunk was simulated in
 
-    unsigned short &operator []( const UShortVec2 pos ) const {
-        return content[pos.x].column[pos.y];
+    tiles::tile get(unsigned short x, unsigned short y) const {
+        tiles::packed_tile t = store.get(x, y);
+        return (tiles::tile){t.id, tiles::unpack_mass(t.mass)};
     }
-};
+    tiles::packed_tile packed(unsigned short x, unsigned short y) const {
+        return store.get(x, y);
+    }
+    unsigned char id(unsigned short x, unsigned short y) const {
+        return store.id(x, y);
+    }
+    void set(unsigned short x, unsigned short y, tiles::tile tile) {
+        store.set(x, y, (tiles::packed_tile){(unsigned char)tile.id, tiles::pack_mass(tile.mass)});
+    }
+    // Moves the tiles and masks down to their smallest forms
+    void compact() {
+        store.compact();
+        adjacency.compact();
+    }
+    size_t memory() const {
+        return sizeof(chunk) + store.heap_bytes() + adjacency.heap_bytes();
+    }
+    void copy_to(region_file::chunk_data &d) const {
+        tile_planes planes;
+        store.copy_to(planes);
+        memcpy(d.id, planes.id, sizeof(d.id));
+        memcpy(d.mass, planes.mass, sizeof(d.mass));
+        adjacency.copy_to((unsigned char (*)[16])d.adjacency);
+    }
+}null_chunk;
 
-Structure LoadStructure(string filename) {
-    Structure s;
-    s.src = filename;
+// Dense grid of chunk slots indexed directly by chunk position
+// Chunks are allocated individually so pointers to them stay valid while the grid fills up
+// Chunks from a save stay as records in the mapped region files until they are first looked up, which only the main thread may do
+struct chunk_grid {
+    vector<unique_ptr<chunk>> slots = vector<unique_ptr<chunk>>(CHUNK_COUNT * CHUNK_COUNT);
+    size_t count = 0;
+
+    // Saved or paged out chunks that have not been decoded yet, empty if nothing was loaded or paged
+    vector<const unsigned char *> pending;
+    vector<unsigned int> pending_size;
+    vector<unsigned short> pending_file;
+    vector<char> pending_dirty; // Paged out with changes that are not saved yet
+    vector<region_file::mapping> files;
+    size_t pending_count = 0;
+
+    // Records decoded ahead of time off the main thread, waiting for find() to take them
+    // Each one keeps a user on its file so the record stays mapped, and is only used if the slot still points at the same record
+    struct decoded {
+        const unsigned char * record;
+        unsigned short file;
+        unique_ptr<chunk> c; // Empty if the record was broken
+    };
+    unordered_map<size_t, decoded> ready;
+
+    // The page file is filled a segment at a time, segments with nothing left in them are used again
+    int page_fd = -1;
+    int page_segment = -1; // The segment being filled, an index into files
+    size_t page_used = 0;
+    size_t page_end = 0;
+    vector<size_t> free_segments;
+
+    chunk_grid() = default;
+    chunk_grid(chunk_grid &&) = default;
+    chunk_grid &operator=(chunk_grid &&other) {
+        close();
+        slots = std::move(other.slots);
+        count = other.count;
+        pending = std::move(other.pending);
+        pending_size = std::move(other.pending_size);
+        pending_file = std::move(other.pending_file);
+        pending_dirty = std::move(other.pending_dirty);
+        files = std::move(other.files);
+        pending_count = other.pending_count;
+        ready = std::move(other.ready);
+        page_fd = other.page_fd;
+        page_segment = other.page_segment;
+        page_used = other.page_used;
+        page_end = other.page_end;
+        free_segments = std::move(other.free_segments);
+        other.files.clear();
+        other.pending_count = 0;
+        other.page_fd = -1;
+        return *this;
+    }
+    ~chunk_grid() {
+        close();
+    }
+    void close() {
+        ready.clear();
+        for(auto &f : files)
+            region_file::unmap(f);
+        files.clear();
+        pending.clear();
+        pending_count = 0;
+        if(page_fd >= 0)
+            ::close(page_fd);
+        page_fd = -1;
+        page_segment = -1;
+    }
+    void prepare_pending() {
+        if(!pending.empty())
+            return;
+        pending.assign(slots.size(), nullptr);
+        pending_size.assign(slots.size(), 0);
+        pending_file.assign(slots.size(), 0);
+        pending_dirty.assign(slots.size(), 0);
+    }
+    bool is_pending(size_t i) const {
+        return pending_count && pending[i];
+    }
+    void release(size_t i) {
+        pending[i] = nullptr;
+        pending_dirty[i] = 0;
+        --pending_count;
+        drop_user(pending_file[i]);
+    }
+    void drop_user(unsigned short f) {
+        region_file::mapping &file = files[f];
+        if(--file.users == 0) {
+            if(file.pages)
+                free_segments.push_back(file.offset);
+            region_file::unmap(file);
+        }
+    }
+    // Whether find() can take the chunk from the ready list instead of decoding it
+    bool is_ready(size_t i) const {
+        if(ready.empty() || !is_pending(i))
+            return false;
+        auto it = ready.find(i);
+        return it != ready.end() && it->second.record == pending[i];
+    }
+    void drop_ready(size_t i) {
+        auto it = ready.find(i);
+        if(it == ready.end())
+            return;
+        drop_user(it->second.file);
+        ready.erase(it);
+    }
 
-    ifstream file(filename);
+    static bool in_bounds(UShortVec2 pos) {
+        return pos.x < CHUNK_COUNT && pos.y < CHUNK_COUNT;
+    }
 
-    if (file.is_open()) {
-        string line;
+    chunk * find(UShortVec2 pos) {
+        if(!in_bounds(pos))
+            return nullptr;
+        size_t i = pos.y*CHUNK_COUNT + pos.x;
+        chunk * c = slots[i].get();
+        if(c || !pending_count || !pending[i])
+            return c;
+        if(is_ready(i)) {
+            unique_ptr<chunk> ahead = std::move(ready[i].c);
+            drop_ready(i);
+            return adopt(i, std::move(ahead));
+        }
+        return decode(i);
+    }
 
-        s.height = 1 + count(istreambuf_iterator<char>(file), istreambuf_iterator<char>(), '\n');
+    // Turns a saved record back into a chunk, a broken record is dropped so the chunk goes back to the terrain
+    chunk * decode(size_t i) {
+        drop_ready(i);
+        return adopt(i, build(pending[i], pending_size[i]));
+    }
+    // Only reads the record, so it can run on any thread while the record's file has a user
+    static unique_ptr<chunk> build(const unsigned char * record, size_t size) {
+        region_file::chunk_data d;
+        if(!region_file::decode(record, size, d))
+            return nullptr;
+        unique_ptr<chunk> c = make_unique<chunk>(null_chunk);
+        c->biome = d.biome;
+        tile_planes &planes = c->store.planes();
+        memcpy(planes.id, d.id, sizeof(d.id));
+        memcpy(planes.mass, d.mass, sizeof(d.mass));
+        c->adjacency.assign((const unsigned char (*)[16])d.adjacency);
+        c->compact();
+        return c;
+    }
+    // Puts a chunk built from slot i's record into the slot in place of the record
+    chunk * adopt(size_t i, unique_ptr<chunk> c) {
+        bool dirty = pending_dirty[i];
+        release(i);
+        if(!c)
+            return nullptr;
+        c->position = {(unsigned short)(i % CHUNK_COUNT), (unsigned short)(i / CHUNK_COUNT)};
+        c->dirty = dirty;
+        slots[i] = std::move(c);
+        ++count;
+        return slots[i].get();
+    }
 
-        string * content = new string[s.height];
+    // Moves a chunk out of memory into the page file, anything pointing at it has to be let go of first
+    bool evict(size_t i) {
+        chunk * c = slots[i].get();
+        region_file::chunk_data d;
+        d.biome = c->biome;
+        c->copy_to(d);
+        vector<unsigned char> record;
+        region_file::encode(d, record);
+
+        if(page_fd < 0)
+            page_fd = region_file::open_pages();
+        if(page_fd < 0)
+            return false;
+        if(page_segment < 0 || page_used + record.size() > files[page_segment].size) {
+            // The page file keeps a user on the segment it is filling so it is not freed under it
+            if(page_segment >= 0 && --files[page_segment].users == 0) {
+                free_segments.push_back(files[page_segment].offset);
+                region_file::unmap(files[page_segment]);
+            }
+            size_t offset = page_end;
+            if(!free_segments.empty()) {
+                offset = free_segments.back();
+                free_segments.pop_back();
+            }
+            else
+                page_end += PAGE_SEGMENT;
+            region_file::mapping m = region_file::map_pages(page_fd, offset, PAGE_SEGMENT);
+            if(!m.data) {
+                page_segment = -1;
+                return false;
+            }
+            m.users = 1;
+            page_segment = files.size();
+            for(size_t f = 0;f<files.size();++f) {
+                if(!files[f].data && !files[f].users) {
+                    page_segment = f;
+                    break;
+                }
+            }
+            if(page_segment == (int)files.size())
+                files.push_back(m);
+            else
+                files[page_segment] = m;
+            page_used = 0;
+        }
 
-        file.clear();
-        file.seekg(0);
+        prepare_pending();
+        unsigned char * dest = (unsigned char *)files[page_segment].data + page_used;
+        memcpy(dest, record.data(), record.size());
+        page_used += record.size();
+        ++files[page_segment].users;
+        pending[i] = dest;
+        pending_size[i] = record.size();
+        pending_file[i] = page_segment;
+        pending_dirty[i] = c->dirty;
+        ++pending_count;
+        slots[i].reset();
+        --count;
+        return true;
+    }
 
-        int i = 0;
-        while (getline(file, line)) {
-            content[i] = line;
-            ++i;
+    // Returns the existing chunk if there already is one
+    chunk * insert(UShortVec2 pos, const chunk &value) {
+        if(!in_bounds(pos))
+            return nullptr;
+        if(chunk * c = find(pos))
+            return c;
+        unique_ptr<chunk> &slot = slots[pos.y*CHUNK_COUNT + pos.x];
+        if(!slot) {
+            slot = make_unique<chunk>(value);
+            slot->position = pos;
+            ++count;
         }
-        file.close();
+        return slot.get();
+    }
 
-        s.width = content[0].length();
+    // Like insert but leaves the count alone, so different slots can be filled from different threads
+    // recount() has to be called once they are done
+    chunk * claim(UShortVec2 pos, const chunk &value, bool &created) {
+        created = false;
+        if(!in_bounds(pos))
+            return nullptr;
+        unique_ptr<chunk> &slot = slots[pos.y*CHUNK_COUNT + pos.x];
+        if(!slot) {
+            slot = make_unique<chunk>(value);
+            slot->position = pos;
+            created = true;
+        }
+        return slot.get();
+    }
+    void recount() {
+        count = 0;
+        for(auto &slot : slots)
+            if(slot)
+                ++count;
+    }
 
-        // Convert into unsigned short **
-        s.content = new tile_column[s.width];
+    size_t size() const {
+        return count;
+    }
+    // Bytes the decoded chunks take up, which depends on what form their tiles are in
+    size_t memory() const {
+        size_t bytes = 0;
+        for(auto &slot : slots)
+            if(slot)
+                bytes += slot->memory();
+        return bytes;
+    }
+    // The most the decoded chunks could take up, for checking the page budget without adding them all up
+    size_t memory_bound() const {
+        return count * (sizeof(chunk) + sizeof(tile_planes) + 256);
+    }
 
-        for(unsigned short x = 0;x<s.width;++x) {
-            s.content[x].column = new unsigned short[s.height];
-            for(unsigned short y = 0;y<s.height;++y) {
-                s[(UShortVec2){x, y}] = content[s.height-y-1][x] - 48;
+    // Visits every decoded chunk row by row
+    template<typename F> void for_each(F fn) {
+        for(unsigned short y = 0;y<CHUNK_COUNT;++y) {
+            for(unsigned short x = 0;x<CHUNK_COUNT;++x) {
+                chunk * c = slots[y*CHUNK_COUNT + x].get();
+                if(c)
+                    fn((UShortVec2){x, y}, c);
             }
         }
+    }
+};
 
-        cout << "Loaded structure (" << s.width << "x" << s.height << ")\n";
+// A circle of tiles written during world generation
+struct stamp {
+    IntVec2 pos;
+    int radius;
+    tiles::tile tile;
+    int randomize; // Only about one in randomize tiles are written, 0 writes them all
+
+    // Air is carved anywhere, anything else only goes in if the centre is still stone
+    bool gated() const {
+        return !tiles::is_air(tile.id);
+    }
+    // The tiles written are (pos - radius/2) up to but not including (pos + radius/2)
+    IntVec2 min() const {
+        return {pos.x - radius/2, pos.y - radius/2};
+    }
+    IntVec2 max() const {
+        return {pos.x + radius/2, pos.y + radius/2};
+    }
+    // Whether a tile in the circle is one of the randomized ones that gets written
+    bool picked(IntVec2 p) const {
+        return !(randomize && Random::Hash64(Random::ORE_MASK, p.x, p.y, pos.x * WORLD_SIZE + pos.y) % randomize);
+    }
+    bool covers(IntVec2 p) const {
+        int dx = p.x - pos.x;
+        int dy = p.y - pos.y;
+        return p.x >= min().x && p.y >= min().y && p.x < max().x && p.y < max().y &&
+            dx*dx + dy*dy <= (radius/2)*(radius/2) && picked(p);
+    }
+    // The rows of the circle inside the box from clip_min up to but not including clip_max, before randomizing
+    void spans(IntVec2 clip_min, IntVec2 clip_max, vector<carve::span> &out) const {
+        carve::circle(pos, radius/2,
+            {std::max(min().x, clip_min.x), std::max(min().y, clip_min.y)},
+            {std::min(max().x, clip_max.x), std::min(max().y, clip_max.y)}, out);
     }
-    return s;
-}
+};
 
 class world_map {
     public:
@@ -115,464 +472,1638 @@ class world_map {
 
     Vector2 *mouse;
 
-    map<UShortVec2, chunk> chunkmap;
-
-    void place_structure(Structure s, IntVec2 pos) {
-        for(int x = pos.x;x<pos.x+s.width;++x) {
-            for(int y = pos.y;y<pos.y+s.height;++y) {
-                unsigned short id = s[(UShortVec2){(unsigned short)(x-pos.x), (unsigned short)(y-pos.y)}];
-                if(id)
-                    set_tile(
-                        (UShortVec2){(unsigned short)(x%16), (unsigned short)(y%16)},
-                        (UShortVec2){(unsigned short)(x/16), (unsigned short)(y/16)},
-                        (tiles::tile){id, tiles::tile_prefabs[id].mass}
-                    );
+    chunk_grid chunks;
+
+    // Does what set_tile would for every non void tile, but copies each column run straight into its chunk
+    // and only works out the shading masks once for the tiles in and around the structure
+    // Writes straight into the chunks, so a running tick is finished first
+    void place_structure(const Structure &s, IntVec2 pos) {
+        finish_tick();
+        vector<chunk *> touched;
+        s.pieces(pos, {0, 0}, {CHUNK_COUNT*16, CHUNK_COUNT*16}, [&](UShortVec2 c_pos, UShortVec2 rel, int length, const unsigned char * ids, const unsigned short * mass) {
+            chunk * c = chunks.find(c_pos);
+            if(!c)
+                c = create_chunk(c_pos);
+            if(!c)
+                return;
+            if(touched.empty() || touched.back() != c)
+                touched.push_back(c);
+            tile_planes &planes = c->store.planes();
+            unsigned char * column = &planes.id[rel.x][rel.y];
+            bool changed = false;
+            bool simulated = false;
+            for(int i = 0;i<length;++i) {
+                IntVec2 tile_pos = {c_pos.x*16 + rel.x, c_pos.y*16 + rel.y + i};
+                simulated |= tiles::is_simulated(column[i]) || tiles::is_simulated(ids[i]);
+                changed |= column[i] != ids[i] && !(tiles::is_air(column[i]) && tiles::is_air(ids[i]));
+                if(tiles::is_transparent(column[i]) != tiles::is_transparent(ids[i])) {
+                    ++wall_changes;
+                    last_wall_change = tile_pos;
+                }
+                if(tiles::is_collidable(column[i]) != tiles::is_collidable(ids[i])) {
+                    ++solid_changes;
+                    last_solid_change = tile_pos;
+                }
             }
-        }
+            memcpy(column, ids, length);
+            memcpy(&planes.mass[rel.x][rel.y], mass, length * sizeof(unsigned short));
+            c->dirty = true;
+            if(changed)
+                ++c->revision;
+            if(simulated)
+                wake(c);
+        });
+
+        for(chunk * c : touched)
+            c->store.compact();
+        refresh_adjacency(pos - (IntVec2){1, 1}, pos + (IntVec2){s.width + 1, s.height + 1});
     }
 
+    // randomize leaves out all but about one in randomize tiles, picked from the position so it is the same in any order
     void fill_circle(IntVec2 pos, int radius, tiles::tile tile, int randomize) {
-        for(int x = -radius/2;x<radius/2;++x) {
-            for(int y = -radius/2;y<radius/2;++y) {
-                if(pos.x + x < 0 || pos.y + y < 0 || pos.x + x > WORLD_SIZE || pos.y + y > WORLD_SIZE)
-                    continue;
+        carve_stamps({{pos, radius, tile, randomize}});
+    }
 
-                if(dist(pos, (IntVec2){pos.x + x, pos.y + y}) <= radius/2 && !(randomize && (rand()%randomize))) {
-                    if(tiles::is_air(tile.id) || get_tile(pos).id == tiles::ID::STONE)
-                        set_tile({ 
-                            (unsigned short)((pos.x+x)%16), 
-                            (unsigned short)((pos.y+y)%16) 
-                        }, { 
-                            (unsigned short)((pos.x+x)/16), 
-                            (unsigned short)((pos.y+y)/16) 
-                        }, tile);
-                }
+    // Writes stamps in order as if each were filled on its own, joining runs of ones with the same tile into one set of row spans
+    // so each tile is written once and each chunk is gone through once
+    void carve_stamps(const vector<stamp> &list) {
+        IntVec2 limit = {std::min(WORLD_SIZE + 1, CHUNK_COUNT*16), std::min(WORLD_SIZE + 1, CHUNK_COUNT*16)};
+        vector<carve::span> pending;
+        tiles::tile pending_tile = tiles::VOID_TILE;
+        for(const stamp &s : list) {
+            bool joins = !pending.empty() && !s.randomize && s.tile.id == pending_tile.id && s.tile.mass == pending_tile.mass;
+            if(!joins && !pending.empty()) {
+                carve_spans(pending, pending_tile);
+                pending.clear();
+            }
+            // The centre might be under stamps that are not written yet
+            if(s.gated() && (joins && carve::contains(pending, s.pos) ? s.tile.id : get_tile(s.pos).id) != tiles::ID::STONE)
+                continue;
+            if(!s.randomize) {
+                s.spans({0, 0}, limit, pending);
+                pending_tile = s.tile;
+                continue;
             }
+            // Randomized stamps only write some of each run, so they go in a tile at a time
+            vector<carve::span> rows;
+            s.spans({0, 0}, limit, rows);
+            vector<pair<IntVec2, tiles::tile>> edits;
+            for(const carve::span &row : rows)
+                for(int x = row.x0;x<row.x1;++x)
+                    if(s.picked({x, row.y}))
+                        edits.push_back({{x, row.y}, s.tile});
+            set_tiles(edits);
         }
+        if(!pending.empty())
+            carve_spans(pending, pending_tile);
     }
 
-    void generate_cave(IntVec2 pos, float size, int len, tiles::tile tile) {
-        float direction = (float(rand())/float(RAND_MAX))*(PI*2);
+    // Writes a tile over row spans inside the world, a chunk at a time
+    void carve_spans(vector<carve::span> &spans, tiles::tile tile) {
+        carve::merge(spans);
+        if(updating) {
+            for(const carve::span &s : spans)
+                for(int x = s.x0;x<s.x1;++x)
+                    post({world_command::SET_TILE, {x, s.y}, tile});
+            return;
+        }
+        // Cut at chunk edges, and the rows of each chunk kept in order
+        vector<pair<unsigned int, carve::span>> pieces;
+        for(const carve::span &s : spans)
+            for(int x = s.x0;x<s.x1;x = (x/16 + 1)*16)
+                pieces.push_back({(unsigned int)((s.y/16)*CHUNK_COUNT + x/16), {s.y, x, std::min(s.x1, (x/16 + 1)*16)}});
+        stable_sort(pieces.begin(), pieces.end(), [](const auto &a, const auto &b) {
+            return a.first < b.first;
+        });
+        for(size_t i = 0;i<pieces.size();) {
+            const carve::span &first = pieces[i].second;
+            UShortVec2 c_pos = {(unsigned short)(first.x0/16), (unsigned short)(first.y/16)};
+            chunk_view v = edit_view(c_pos);
+            size_t end = i;
+            for(;end<pieces.size() && pieces[end].first == pieces[i].first;++end) {
+                const carve::span &s = pieces[end].second;
+                for(int x = s.x0;x<s.x1;++x)
+                    v.set(x - c_pos.x*16, s.y - c_pos.y*16, tile);
+            }
+            v.finish();
+            i = end;
+        }
+    }
+
+    // Works out the circles a wandering cave is made of
+    void cave_stamps(IntVec2 pos, float size, int len, tiles::tile tile, Random::Stream &rng, vector<stamp> &out) {
+        float direction = rng.Float()*(PI*2);
         float sv = 0;
         Vector2 loc = {(float)pos.x, (float)pos.y};
         for(int i = 0; i < len; ++i) {
             loc.x+=sin(direction)*(size/3);
             loc.y+=cos(direction)*(size/3);
-            direction += (float(rand())/float(RAND_MAX) - 0.5f)*(PI/2);
-            sv+=(float(rand())/float(RAND_MAX) - 0.5); 
+            direction += (rng.Float() - 0.5f)*(PI/2);
+            sv+=(rng.Float() - 0.5); 
             size+=sv;
             if(size > MAX_CAVE_SIZE || size < MIN_CAVE_SIZE) {
                 size-=sv;
                 
                 sv = -sv;
             }
-            fill_circle({(int)loc.x, (int)loc.y}, size, tile, 0);
+            out.push_back({{(int)loc.x, (int)loc.y}, (int)size, tile, 0});
         }
     }
 
-    void generate() {
+    void cave_stamps(IntVec2 pos, float size, int len, tiles::tile tile, vector<stamp> &out) {
+        Random::Stream rng(Random::CAVE_PATH, pos.x, pos.y);
+        cave_stamps(pos, size, len, tile, rng, out);
+    }
+
+    // Caves wander using numbers drawn from their own stream, keyed by where they start unless one is given
+    void generate_cave(IntVec2 pos, float size, int len, tiles::tile tile) {
+        Random::Stream rng(Random::CAVE_PATH, pos.x, pos.y);
+        generate_cave(pos, size, len, tile, rng);
+    }
+    void generate_cave(IntVec2 pos, float size, int len, tiles::tile tile, Random::Stream &rng) {
+        vector<stamp> path;
+        cave_stamps(pos, size, len, tile, rng, path);
+        carve_stamps(path);
+    }
+
+    // The generated terrain is never written out, every tile is worked out from the seed and the list of stamps when it is read
+    // and only chunks that get edited are stored. Structures are the exception, they are written straight into chunk memory
+    // split into square regions of chunks, one worker per region.
+    // Carved stamps (like the caves the player starts in) are stored and simulated straight away, they go in just before the structures
+    typedef function<void(const char * stage, float progress)> progress_callback;
+
+    void generate(progress_callback progress = nullptr, const vector<pair<const Structure *, IntVec2>> &structures = {}, const vector<stamp> &carved = {}) {
+        finish_tick();
+        if(!workers)
+            workers = make_unique<thread_pool>(thread_count);
+        generated.assign(CHUNK_COUNT * CHUNK_COUNT, 0);
+        stamps.clear();
+        stamp_index.assign(CHUNK_COUNT * CHUNK_COUNT, {});
+
+        // Every cave, ore and deposit gets its own stream so any one of them can be worked out on its own
+        if(progress)
+            progress("Caves", 0);
+        vector<stamp> stage;
         for(int i = 0;i<CAVE_COUNT;++i) {
-            IntVec2 pos = {rand()%WORLD_SIZE, rand()%WORLD_SIZE};
+            Random::Stream rng(Random::CAVE, i);
+            IntVec2 pos = {rng.Int(WORLD_SIZE), rng.Int(WORLD_SIZE)};
             while(dist(pos, (IntVec2){WORLD_SIZE/2, WORLD_SIZE/2}) < 60)
-                pos = {rand()%WORLD_SIZE, rand()%WORLD_SIZE};
-            generate_cave(pos, (rand()%(MAX_CAVE_SIZE-MIN_CAVE_SIZE))+MIN_CAVE_SIZE, (rand()%(MAX_CAVE_LEN-MIN_CAVE_LEN))+MIN_CAVE_LEN, {tiles::ID::VACUMN, 0});
-            cout << "Generating World: " << round((float(i)/float(CAVE_COUNT))*1000)/10 << "%\n";
+                pos = {rng.Int(WORLD_SIZE), rng.Int(WORLD_SIZE)};
+            int size = rng.Int(MIN_CAVE_SIZE, MAX_CAVE_SIZE);
+            cave_stamps(pos, size, rng.Int(MIN_CAVE_LEN, MAX_CAVE_LEN), {tiles::ID::VACUMN, 0}, rng, stage);
         }
+        add_stamps(stage);
 
+        if(progress)
+            progress("Ores", 0.25f);
+        stage.clear();
         for(int i = 0;i<ORES;++i) {
-            fill_circle((IntVec2){rand()%WORLD_SIZE, rand()%WORLD_SIZE}, 1 + (rand()%4), tiles::from_id(tiles::ID::COPPER), 2);
+            Random::Stream rng(Random::ORE, i);
+            IntVec2 pos = {rng.Int(WORLD_SIZE), rng.Int(WORLD_SIZE)};
+            stage.push_back({pos, rng.Int(1, 5), tiles::from_id(tiles::ID::COPPER), 2});
         }
+        add_stamps(stage);
 
+        if(progress)
+            progress("Deposits", 0.5f);
+        stage.clear();
         for(int i = 0;i<DEPOSITS;++i) {
-            generate_cave((IntVec2){rand()%WORLD_SIZE, rand()%WORLD_SIZE}, 2+(rand()%4), 2+(rand()%2), tiles::from_id(tiles::ID::SILT));
+            Random::Stream rng(Random::DEPOSIT, i);
+            IntVec2 pos = {rng.Int(WORLD_SIZE), rng.Int(WORLD_SIZE)};
+            int size = rng.Int(2, 6);
+            cave_stamps(pos, size, rng.Int(2, 4), tiles::from_id(tiles::ID::SILT), rng, stage);
         }
+        add_stamps(stage);
+
+        if(progress)
+            progress("Structures", 0.75f);
+        carve_stamps(carved);
+        generate_structures(structures);
+        finish_generation();
+        if(progress)
+            progress("Done", 1);
         log = true;
     }
 
-    auto create_chunk(UShortVec2 pos) {
-        chunkmap.insert(pair<UShortVec2, chunk>( pos, null_chunk ));
-        if(log) {
+    // The stamps that made it into the terrain, and for each chunk the ones that touch it in the order they went in
+    vector<stamp> stamps;
+    vector<vector<int>> stamp_index;
+
+    // Chunks that generation wrote simulated tiles into, indexed like the chunk grid
+    vector<char> generated;
+
+    // Adds stamps to the terrain in order, gated stamps that would not find stone at their centre are left out
+    void add_stamps(const vector<stamp> &stage) {
+        for(const stamp &s : stage) {
+            if(s.gated() && get_tile(s.pos).id != tiles::ID::STONE)
+                continue;
+            if(s.max().x <= 0 || s.max().y <= 0 || s.min().x > WORLD_SIZE || s.min().y > WORLD_SIZE)
+                continue;
+
+            int i = stamps.size();
+            stamps.push_back(s);
+            IntVec2 c_min = {std::max(s.min().x, 0) / 16, std::max(s.min().y, 0) / 16};
+            IntVec2 c_max = {std::min(s.max().x - 1, WORLD_SIZE) / 16, std::min(s.max().y - 1, WORLD_SIZE) / 16};
+            for(int y = c_min.y;y<=c_max.y;++y)
+                for(int x = c_min.x;x<=c_max.x;++x)
+                    stamp_index[y*CHUNK_COUNT + x].push_back(i);
+        }
+    }
+
+    // The starting tile only depends on the seed and where it is
+    static unsigned char terrain_id(IntVec2 pos) {
+        if(Random::At(Random::TERRAIN, pos.x, pos.y) < 0.998)
+            return tiles::ID::STONE;
+        return tiles::ID::TITANIUM;
+    }
+    // What a tile holds before any stamps
+    static tiles::tile starting_tile(IntVec2 pos) {
+        if(pos.x<0 || pos.y<0 || pos.x>WORLD_SIZE || pos.y>WORLD_SIZE)
+            return tiles::VOID_TILE;
+        return tiles::from_id(terrain_id(pos));
+    }
+    // What a tile that has never been edited holds, safe to call from any thread
+    tiles::tile terrain_tile(IntVec2 pos) const {
+        if(pos.x<0 || pos.y<0 || pos.x>WORLD_SIZE || pos.y>WORLD_SIZE)
+            return tiles::VOID_TILE;
+        tiles::tile t = tiles::from_id(terrain_id(pos));
+        if(stamp_index.empty())
+            return t;
+        for(int i : stamp_index[(pos.y/16)*CHUNK_COUNT + pos.x/16])
+            if(stamps[i].covers(pos))
+                t = stamps[i].tile;
+        return t;
+    }
+    // Does what terrain_tile would for every tile in the chunk, but writes each stamp's rows over the starting tiles in order
+    void fill_terrain(chunk * c, UShortVec2 c_pos) const {
+        c->position = c_pos;
+        tile_planes planes;
+        for(int x = 0;x<16;++x) {
+            for(int y = 0;y<16;++y) {
+                tiles::tile t = starting_tile((IntVec2){c_pos.x*16 + x, c_pos.y*16 + y});
+                planes.id[x][y] = t.id;
+                planes.mass[x][y] = tiles::pack_mass(t.mass);
+            }
+        }
+        if(!stamp_index.empty() && chunk_grid::in_bounds(c_pos)) {
+            IntVec2 min = {c_pos.x*16, c_pos.y*16};
+            IntVec2 max = {std::min(min.x + 16, WORLD_SIZE + 1), std::min(min.y + 16, WORLD_SIZE + 1)};
+            vector<carve::span> rows;
+            for(int i : stamp_index[c_pos.y*CHUNK_COUNT + c_pos.x]) {
+                const stamp &s = stamps[i];
+                unsigned short mass = tiles::pack_mass(s.tile.mass);
+                rows.clear();
+                s.spans(min, max, rows);
+                for(const carve::span &row : rows) {
+                    for(int x = row.x0;x<row.x1;++x) {
+                        if(!s.picked({x, row.y}))
+                            continue;
+                        planes.id[x - min.x][row.y - min.y] = s.tile.id;
+                        planes.mass[x - min.x][row.y - min.y] = mass;
+                    }
+                }
+            }
+        }
+        c->store.assign(planes);
+        c->store.compact();
+    }
+    // Neighbours inside the chunk are read from it, only the ring around it goes through get_tile
+    void fill_adjacency(chunk * c) {
+        unsigned char masks[16][16];
+        for(int x = 0;x<16;++x) {
+            for(int y = 0;y<16;++y) {
+                unsigned char walls = 0;
+                unsigned char gas = 0;
+                for(int i = 0;i<4;++i) {
+                    int nx = x + neighbors[i].x;
+                    int ny = y + neighbors[i].y;
+                    IntVec2 pos = {c->position.x*16 + nx, c->position.y*16 + ny};
+                    bool inside = nx>=0 && ny>=0 && nx<16 && ny<16 && pos.x<=WORLD_SIZE && pos.y<=WORLD_SIZE;
+                    unsigned short id = inside ? c->id(nx, ny) : get_tile(pos).id;
+                    if(tiles::is_collidable(id))
+                        walls |= 1 << i;
+                    if(!gas && tiles::is_air(id))
+                        gas = i + 1;
+                }
+                masks[x][y] = walls | (gas << 4);
+            }
+        }
+        c->adjacency.assign(masks);
+        c->adjacency.compact();
+    }
+
+    static int region_count() {
+        return (CHUNK_COUNT + GEN_REGION - 1) / GEN_REGION;
+    }
+    // Which regions a box of tiles (max not included) overlaps, clipped to the tiles up to limit
+    static void region_span(IntVec2 min, IntVec2 max, int limit, IntVec2 &r_min, IntVec2 &r_max) {
+        r_min = {std::max(min.x, 0) / (16*GEN_REGION), std::max(min.y, 0) / (16*GEN_REGION)};
+        r_max = {std::min(max.x - 1, limit) / (16*GEN_REGION), std::min(max.y - 1, limit) / (16*GEN_REGION)};
+    }
+    // The tiles a region covers, max not included
+    static void region_bounds(size_t r, IntVec2 &r_min, IntVec2 &r_max) {
+        r_min = {(int)(r % region_count()) * 16*GEN_REGION, (int)(r / region_count()) * 16*GEN_REGION};
+        r_max = {std::min(r_min.x + 16*GEN_REGION, CHUNK_COUNT*16), std::min(r_min.y + 16*GEN_REGION, CHUNK_COUNT*16)};
+    }
+
+    // Copies a run of tiles up one column of a chunk during generation, the chunk has to be in the calling worker's region
+    void generate_span(UShortVec2 c_pos, UShortVec2 rel, int length, const unsigned char * ids, const unsigned short * mass) {
+        bool created;
+        chunk * c = chunks.claim(c_pos, null_chunk, created);
+        // Adjacency reads other regions so it waits for finish_generation
+        if(created)
+            fill_terrain(c, c_pos);
+        tile_planes &planes = c->store.planes();
+        unsigned char * column = &planes.id[rel.x][rel.y];
+        for(int i = 0;i<length;++i) {
+            if(tiles::is_simulated(column[i]) || tiles::is_simulated(ids[i]))
+                generated[c_pos.y*CHUNK_COUNT + c_pos.x] = 1;
+        }
+        memcpy(column, ids, length);
+        memcpy(&planes.mass[rel.x][rel.y], mass, length * sizeof(unsigned short));
+    }
+
+    void generate_structures(const vector<pair<const Structure *, IntVec2>> &structures) {
+        int count = region_count();
+        vector<vector<int>> regions(count * count);
+        for(size_t i = 0;i<structures.size();++i) {
+            IntVec2 pos = structures[i].second;
+            IntVec2 end = pos + (IntVec2){structures[i].first->width, structures[i].first->height};
+            if(end.x <= 0 || end.y <= 0 || pos.x >= CHUNK_COUNT*16 || pos.y >= CHUNK_COUNT*16)
+                continue;
+            IntVec2 r_min, r_max;
+            region_span(pos, end, CHUNK_COUNT*16 - 1, r_min, r_max);
+            for(int y = r_min.y;y<=r_max.y;++y)
+                for(int x = r_min.x;x<=r_max.x;++x)
+                    regions[y*count + x].push_back(i);
+        }
+
+        // Like place_structure these go right up to the edge of the last chunks
+        workers->run(regions.size(), [&](size_t r) {
+            IntVec2 r_min, r_max;
+            region_bounds(r, r_min, r_max);
+            for(int i : regions[r]) {
+                structures[i].first->pieces(structures[i].second, r_min, r_max, [this](UShortVec2 c_pos, UShortVec2 rel, int length, const unsigned char * ids, const unsigned short * mass) {
+                    generate_span(c_pos, rel, length, ids, mass);
+                });
+            }
+        });
+    }
+
+    // Brings everything set_tile would have kept up to date in line with the generated tiles
+    void finish_generation() {
+        chunks.recount();
+        // Tiles are packed down before any masks are worked out since those read the neighbouring chunks
+        workers->run(chunks.slots.size(), [this](size_t i) {
+            if(chunks.slots[i])
+                chunks.slots[i]->store.compact();
+        }, 16);
+        workers->run(chunks.slots.size(), [this](size_t i) {
+            if(chunks.slots[i])
+                fill_adjacency(chunks.slots[i].get());
+        }, 16);
+        for(size_t i = 0;i<generated.size();++i)
+            if(generated[i])
+                wake(chunks.slots[i].get());
+        generated.clear();
+        view_positions.assign(TERRAIN_VIEWS*TERRAIN_VIEWS, NO_VIEW);
+        ++wall_changes;
+        // More than one change, so everything around every body is read again
+        solid_changes += 2;
+    }
+
+    // Stores a chunk, starting out as the terrain
+    chunk * create_chunk(UShortVec2 pos) {
+        chunk * c = chunks.insert(pos, null_chunk);
+        if(c) {
+            fill_terrain(c, pos);
+            fill_adjacency(c);
+            forget_view(pos);
+        }
+        if(log && c) {
             cout << "[World] -> New chunk made at " << pos.x << ", " << pos.y << " (id: " << pos.id() << ")\n";
-            cout << "               Map size increased to " << pretty_size( chunkmap.size() * (sizeof(chunk) + sizeof(UShortVec2)) ) << endl;
+            cout << "               Map size increased to " << pretty_size( chunks.memory() ) << endl;
         }
-        return chunkmap.find(pos);
+        return c;
     }
 
     void set_tile(UShortVec2 rel_pos, UShortVec2 c_pos, tiles::tile tile) {
-        auto c = chunkmap.find(c_pos);
-        if(c == chunkmap.end()) {
+        IntVec2 pos = {c_pos.x*16 + rel_pos.x, c_pos.y*16 + rel_pos.y};
+        // The workers are reading the front buffers, so the edit is applied once the tick is swapped in
+        if(updating) {
+            post({world_command::SET_TILE, pos, tile});
+            return;
+        }
+        chunk * c = chunks.find(c_pos);
+        if(!c)
             c = create_chunk(c_pos);
+        // Outside of the world
+        if(!c)
+            return;
+        bool masks = write_tile(c, rel_pos, tile);
+        if(!c->awake)
+            c->store.compact();
+
+        // The neighbours' shading only cares whether this tile is a wall or gas
+        if(masks) {
+            for(int i = 0;i<4;++i)
+                update_adjacency(pos + neighbors[i]);
         }
-        c->second.content[rel_pos.x][rel_pos.y]= tile;
     }
-    chunk * get_chunk(UShortVec2 pos) {
-        if(pos.x<0 || pos.y<0 || pos.x>WORLD_SIZE/16 || pos.y>WORLD_SIZE/16)
+    // Everything set_tile does to the tile's own chunk, returns whether the neighbours' shading has to be worked out again
+    // The chunk is left for the caller to pack down
+    bool write_tile(chunk * c, UShortVec2 rel_pos, tiles::tile tile) {
+        IntVec2 pos = {c->position.x*16 + rel_pos.x, c->position.y*16 + rel_pos.y};
+        if(tiles::is_simulated(tile.id) || tiles::is_simulated(c->id(rel_pos.x, rel_pos.y)))
+            wake(c);
+        unsigned short old = c->id(rel_pos.x, rel_pos.y);
+        if(tiles::is_transparent(tile.id) != tiles::is_transparent(old)) {
+            ++wall_changes;
+            last_wall_change = pos;
+        }
+        if(tiles::is_collidable(tile.id) != tiles::is_collidable(old)) {
+            ++solid_changes;
+            last_solid_change = pos;
+        }
+        c->set(rel_pos.x, rel_pos.y, tile);
+        c->dirty = true;
+        if(tile.id != old && !(tiles::is_air(tile.id) && tiles::is_air(old)))
+            ++c->revision;
+        return tiles::is_collidable(tile.id) != tiles::is_collidable(old) || tiles::is_air(tile.id) != tiles::is_air(old);
+    }
+    // Chunks that are not stored come back as a read only copy of the terrain, which is only good until the next call
+    // Callers that only want the tiles can leave the copy's shading masks out
+    chunk * get_chunk(UShortVec2 pos, bool masks = true) {
+        if(pos.x>WORLD_SIZE/16 || pos.y>WORLD_SIZE/16)
             return &null_chunk;
 
-        auto c = chunkmap.find(pos);
+        chunk * c = need(pos);
+        if(!c)
+            return terrain_view(pos, masks);
 
-        // Create a new tile if the selected tile or its chunk does not exist
-        if(c == chunkmap.end())
-            return &null_chunk;
+        return c;
+    }
 
-        return &c->second;
+    // Paging
+    size_t page_budget = PAGE_BUDGET;
+    unsigned long long page_clock = 0;
+    IntVec2 page_focus = {WORLD_SIZE/2, WORLD_SIZE/2};
+    struct {
+        unsigned long long hits = 0;       // Chunks the renderer or simulation needed that were in memory or already decoded
+        unsigned long long misses = 0;     // ... that had to be decoded there and then
+        unsigned long long evictions = 0;
+        unsigned long long prefetches = 0; // Records handed to the decoder thread
+    } page_stats;
+
+    // Records around the player are decoded on this thread between page() calls, and go into chunks.ready once it is done
+    struct decode_job {
+        size_t slot;
+        const unsigned char * record;
+        unsigned int size;
+        unsigned short file;
+        unique_ptr<chunk> c;
+    };
+    struct decode_batch {
+        vector<decode_job> jobs;
+        atomic<bool> done = false;
+    };
+    thread decoder;
+    shared_ptr<decode_batch> decoding;
+
+    // Looks up a chunk for the renderer or the simulation, keeping it from being paged out for a while
+    chunk * need(UShortVec2 pos) {
+        if(!chunk_grid::in_bounds(pos))
+            return nullptr;
+        size_t i = pos.y*CHUNK_COUNT + pos.x;
+        if(chunks.slots[i] || chunks.is_ready(i))
+            ++page_stats.hits;
+        else if(chunks.is_pending(i))
+            ++page_stats.misses;
+        chunk * c = chunks.find(pos);
+        if(c)
+            c->last_used = page_clock;
+        return c;
     }
 
-    void set_mass(IntVec2 pos, float mass) {
-        auto c = chunkmap.find((UShortVec2){(unsigned short)(pos.x/16), (unsigned short)(pos.y/16)});
-        if(c == chunkmap.end())
+    // Takes what the decoder thread finished, waiting for it if asked to
+    void collect_decoded(bool wait = false) {
+        if(!decoder.joinable() || (!wait && !decoding->done))
             return;
-        c->second.content[pos.x%16][pos.y%16].mass = mass;
+        decoder.join();
+        for(decode_job &job : decoding->jobs)
+            chunks.ready[job.slot] = {job.record, job.file, std::move(job.c)};
+        decoding.reset();
     }
 
-    tiles::tile create_tile(UShortVec2 rel_pos, UShortVec2 c_pos) {
-        unsigned short id = 0;
-        float r = float(rand())/float(RAND_MAX);
+    // Runs between ticks, has the chunks around the player decoded ahead of time on another thread
+    // and pages out the least recently used chunks when over budget
+    void page() {
+        ++page_clock;
+        IntVec2 focus = {page_focus.x/16, page_focus.y/16};
+        collect_decoded();
+        if(!chunks.ready.empty()) {
+            // Ones the player went away from before they were needed
+            for(auto it = chunks.ready.begin();it != chunks.ready.end();) {
+                size_t i = it->first;
+                bool near = abs((int)(i % CHUNK_COUNT) - focus.x) <= PAGE_KEEP_RADIUS + 2 && abs((int)(i / CHUNK_COUNT) - focus.y) <= PAGE_KEEP_RADIUS + 2;
+                if(near && chunks.is_ready(i)) {
+                    ++it;
+                    continue;
+                }
+                chunks.drop_user(it->second.file);
+                it = chunks.ready.erase(it);
+            }
+        }
+        if(chunks.pending_count && !decoder.joinable()) {
+            auto batch = make_shared<decode_batch>();
+            for(int y = focus.y - PAGE_KEEP_RADIUS - 1;y<=focus.y + PAGE_KEEP_RADIUS + 1;++y) {
+                for(int x = focus.x - PAGE_KEEP_RADIUS - 1;x<=focus.x + PAGE_KEEP_RADIUS + 1;++x) {
+                    if(x < 0 || y < 0 || x >= CHUNK_COUNT || y >= CHUNK_COUNT)
+                        continue;
+                    size_t i = y*CHUNK_COUNT + x;
+                    if(!chunks.is_pending(i) || chunks.ready.count(i))
+                        continue;
+                    ++chunks.files[chunks.pending_file[i]].users;
+                    batch->jobs.push_back({i, chunks.pending[i], chunks.pending_size[i], chunks.pending_file[i], nullptr});
+                    ++page_stats.prefetches;
+                }
+            }
+            if(!batch->jobs.empty()) {
+                decoding = batch;
+                decoder = thread([batch]() {
+                    profiler::name_thread("Decoder");
+                    for(decode_job &job : batch->jobs)
+                        job.c = chunk_grid::build(job.record, job.size);
+                    batch->done = true;
+                });
+            }
+        }
 
-        if(r < 0.998)
-            id = tiles::ID::STONE;
-        else
-            id = tiles::ID::TITANIUM;
+        // Adding up what every chunk takes is not free, so it is only checked every few ticks
+        if(!page_budget || chunks.memory_bound() <= page_budget || page_clock % PAGE_CHECK_TICKS)
+            return;
+        size_t memory = chunks.memory();
+        if(memory <= page_budget)
+            return;
 
-        set_tile(rel_pos, c_pos, (tiles::tile){id, tiles::tile_prefabs[id].mass});
-        return (tiles::tile){id, tiles::tile_prefabs[id].mass};
+        // Page down to three quarters of the budget so this does not run every tick
+        vector<pair<unsigned long long, size_t>> candidates;
+        for(size_t i = 0;i<chunks.slots.size();++i) {
+            chunk * c = chunks.slots[i].get();
+            if(!c || c->awake || c->last_used + 1 >= page_clock)
+                continue;
+            if(abs(c->position.x - focus.x) <= PAGE_KEEP_RADIUS && abs(c->position.y - focus.y) <= PAGE_KEEP_RADIUS)
+                continue;
+            candidates.push_back({c->last_used, i});
+        }
+        sort(candidates.begin(), candidates.end());
+        size_t target = page_budget / 4 * 3;
+        for(auto &candidate : candidates) {
+            if(memory <= target)
+                break;
+            chunk * c = chunks.slots[candidate.second].get();
+            size_t bytes = c->memory();
+            chunk_textures.forget(c);
+            if(!chunks.evict(candidate.second))
+                break;
+            memory -= bytes;
+            ++page_stats.evictions;
+        }
     }
-    tiles::tile create_tile_c(UShortVec2 pos, chunk * c) {
-        unsigned short id = 0;
-        float r = float(rand())/float(RAND_MAX);
 
-        if(r < 0.998)
-            id = tiles::ID::STONE;
-        else
-            id = tiles::ID::TITANIUM;
+    // Copies of the terrain for chunks that are on screen but not stored, laid out as a window that repeats over the world
+    // The copies never move, and get a new revision from view_revision whenever they are refilled so the chunk cache sees the change
+    vector<chunk> terrain_views = vector<chunk>(TERRAIN_VIEWS*TERRAIN_VIEWS);
+    vector<UShortVec2> view_positions = vector<UShortVec2>(TERRAIN_VIEWS*TERRAIN_VIEWS, NO_VIEW);
+    vector<char> view_masked = vector<char>(TERRAIN_VIEWS*TERRAIN_VIEWS, 0); // Whether a copy's masks have been worked out yet
+    unsigned int view_revision = 0;
+
+    chunk * terrain_view(UShortVec2 pos, bool masks = true) {
+        size_t i = (pos.y%TERRAIN_VIEWS)*TERRAIN_VIEWS + pos.x%TERRAIN_VIEWS;
+        chunk * v = &terrain_views[i];
+        if(!(view_positions[i] == pos)) {
+            fill_terrain(v, pos);
+            v->revision = ++view_revision;
+            view_positions[i] = pos;
+            view_masked[i] = 0;
+        }
+        if(masks && !view_masked[i]) {
+            fill_adjacency(v);
+            view_masked[i] = 1;
+        }
+        return v;
+    }
+    void forget_view(UShortVec2 pos) {
+        size_t i = (pos.y%TERRAIN_VIEWS)*TERRAIN_VIEWS + pos.x%TERRAIN_VIEWS;
+        if(view_positions[i] == pos)
+            view_positions[i] = NO_VIEW;
+    }
 
-        c->content[pos.x][pos.y] = (tiles::tile){id, tiles::tile_prefabs[id].mass};
-        return (tiles::tile){id, tiles::tile_prefabs[id].mass};
+    void set_mass(IntVec2 pos, float mass) {
+        if(pos.x<0 || pos.y<0)
+            return;
+        UShortVec2 c_pos = {(unsigned short)(pos.x/16), (unsigned short)(pos.y/16)};
+        if(updating) {
+            post({world_command::SET_MASS, pos, {tiles::ID::VOID, mass}});
+            return;
+        }
+        chunk * c = chunks.find(c_pos);
+        if(!c)
+            c = create_chunk(c_pos);
+        if(!c)
+            return;
+        c->store.set(pos.x%16, pos.y%16, (tiles::packed_tile){c->id(pos.x%16, pos.y%16), tiles::pack_mass(mass)});
+        c->dirty = true;
+        wake(c);
     }
 
-    // Tile getting operations
+    // Tile getting operations, none of these store anything
     tiles::tile get_tile(IntVec2 pos) {
         if(pos.x<0 || pos.y<0 || pos.x>WORLD_SIZE || pos.y>WORLD_SIZE)
             return tiles::VOID_TILE;
 
-        auto c = chunkmap.find( (UShortVec2){ 
+        // Commands waiting for the tick to finish are already what the main thread sees
+        if(!posted.empty()) {
+            auto it = posted.find(posted_key(pos));
+            if(it != posted.end()) {
+                tiles::tile t = it->second.set_tile ? it->second.tile : stored_tile(pos);
+                if(it->second.set_mass)
+                    t.mass = it->second.mass;
+                return t;
+            }
+        }
+        return stored_tile(pos);
+    }
+    tiles::tile stored_tile(IntVec2 pos) {
+        chunk * c = chunks.find( (UShortVec2){ 
             (unsigned short)(pos.x/16), 
             (unsigned short)(pos.y/16) 
         } );
 
-        // Create a new tile if the selected tile or its chunk does not exist
-        if(c == chunkmap.end() || c->second[pos.x%16][pos.y%16].id == 0) {
-            return create_tile({ 
-                (unsigned short)(pos.x%16), 
-                (unsigned short)(pos.y%16) 
-            }, { 
-                (unsigned short)(pos.x/16), 
-                (unsigned short)(pos.y/16) 
-            });
-        }
+        // Tiles in chunks that were never edited are still the terrain
+        if(!c)
+            return terrain_tile(pos);
 
-        return c->second[pos.x%16][pos.y%16];
+        return c->get(pos.x%16, pos.y%16);
     }
-    tiles::tile get_tile_c(UShortVec2 pos, chunk * c) {
-        if(pos.x<0 || pos.y<0 || pos.x>15 || pos.y>15)
+    tiles::tile get_tile_c(UShortVec2 pos, chunk * c) const {
+        if(pos.x>15 || pos.y>15)
             return tiles::VOID_TILE;
-        // Create a new tile if the selected tile or its chunk does not exist
-        if(c->content[pos.x][pos.y].id == 0)
-            return create_tile_c(pos, c);
-        return c->content[pos.x][pos.y];
+        return c->get(pos.x, pos.y);
     }
-    tiles::tile get_tile_c_safe(IntVec2 abs_pos, UShortVec2 c_pos, chunk * c) {
-        if(abs_pos.x<0 || abs_pos.y<0 || abs_pos.x>WORLD_SIZE || abs_pos.y>WORLD_SIZE)
-            return tiles::VOID_TILE;
-        if(c_pos.x != (unsigned short)(abs_pos.x/16) || c_pos.y != (unsigned short)(abs_pos.y/16) )
-            return get_tile(abs_pos);
-        else
-            return get_tile_c((UShortVec2){(unsigned short)(abs_pos.x%16), (unsigned short)(abs_pos.y%16)}, c);
+
+    // Queries over many tiles, which look each chunk up once instead of once a tile
+    // Like get_chunk, chunks that are not stored are read as copies of the terrain that are only good until the next lookup
+
+    // The part of a box of tiles in one chunk, max not included
+    struct chunk_span {
+        UShortVec2 c_pos;
+        chunk * c;
+        bool stored;
+        IntVec2 min, max; // World tile positions
+    };
+    // Calls fn(const chunk_span &) for each chunk a box of tiles (max not included) overlaps, a row of chunks at a time from the bottom
+    template<typename F> void for_each_span(IntVec2 min, IntVec2 max, F fn) {
+        min = {std::max(min.x, 0), std::max(min.y, 0)};
+        max = {std::min(max.x, CHUNK_COUNT*16), std::min(max.y, CHUNK_COUNT*16)};
+        if(min.x >= max.x || min.y >= max.y)
+            return;
+        for(int cy = min.y/16;cy*16<max.y;++cy) {
+            for(int cx = min.x/16;cx*16<max.x;++cx) {
+                UShortVec2 c_pos = {(unsigned short)cx, (unsigned short)cy};
+                chunk * c = need(c_pos);
+                bool stored = c != nullptr;
+                if(!c)
+                    c = terrain_view(c_pos, false);
+                chunk_span s = {
+                    c_pos, c, stored,
+                    {std::max(min.x, cx*16), std::max(min.y, cy*16)},
+                    {std::min(max.x, cx*16 + 16), std::min(max.y, cy*16 + 16)}
+                };
+                fn(s);
+            }
+        }
     }
 
-    tiles::tile unsafe_get_tile(IntVec2 pos) {
+    // A chunk and the ring of tiles around it, for code that looks at each tile's neighbours
+    // Tiles from -1 to 16 on each side can be read, writes are only for the chunk's own tiles and only on a view from edit_view()
+    struct chunk_view {
+        world_map * world;
+        UShortVec2 c_pos;
+        chunk * around[9]; // Rows of three from the bottom left, the chunk itself in the middle
+        IntVec2 changed_min = {16, 16}, changed_max = {-1, -1}; // Tiles whose neighbours' masks are out of date
+
+        chunk * self() const {
+            return around[4];
+        }
+        tiles::tile get(int x, int y) const {
+            int abs_x = c_pos.x*16 + x;
+            int abs_y = c_pos.y*16 + y;
+            if(abs_x<0 || abs_y<0 || abs_x>WORLD_SIZE || abs_y>WORLD_SIZE)
+                return tiles::VOID_TILE;
+            return around[((y + 16)/16)*3 + (x + 16)/16]->get(x & 15, y & 15);
+        }
+        unsigned char adjacency(int x, int y) const {
+            unsigned char walls = 0;
+            unsigned char gas = 0;
+            for(int i = 0;i<4;++i) {
+                unsigned short id = get(x + neighbors[i].x, y + neighbors[i].y).id;
+                if(tiles::is_collidable(id))
+                    walls |= 1 << i;
+                if(!gas && tiles::is_air(id))
+                    gas = i + 1;
+            }
+            return walls | (gas << 4);
+        }
+
+        // Does what set_tile would, except the masks around the tiles written are only worked out by finish()
+        void set(int x, int y, tiles::tile tile) {
+            if(world->updating) {
+                world->post({world_command::SET_TILE, {c_pos.x*16 + x, c_pos.y*16 + y}, tile});
+                return;
+            }
+            if(!self() || !world->write_tile(self(), {(unsigned short)x, (unsigned short)y}, tile))
+                return;
+            changed_min = {std::min(changed_min.x, x), std::min(changed_min.y, y)};
+            changed_max = {std::max(changed_max.x, x), std::max(changed_max.y, y)};
+        }
+        void finish() {
+            if(!self() || world->updating)
+                return;
+            if(!self()->awake)
+                self()->store.compact();
+            if(changed_max.x >= 0)
+                world->refresh_adjacency(
+                    {c_pos.x*16 + changed_min.x - 1, c_pos.y*16 + changed_min.y - 1},
+                    {c_pos.x*16 + changed_max.x + 2, c_pos.y*16 + changed_max.y + 2}
+                );
+            changed_min = {16, 16};
+            changed_max = {-1, -1};
+        }
+    };
+    // Copies of the terrain only get their shading masks if they are wanted for the chunk in the middle
+    chunk_view view(UShortVec2 c_pos, bool masks = false) {
+        chunk_view v = {this, c_pos, {}, {16, 16}, {-1, -1}};
+        for(int dy = -1;dy<=1;++dy)
+            for(int dx = -1;dx<=1;++dx)
+                v.around[(dy + 1)*3 + dx + 1] = get_chunk({(unsigned short)(c_pos.x + dx), (unsigned short)(c_pos.y + dy)}, masks && !dx && !dy);
+        return v;
+    }
+    // The chunk in the middle is stored first so it can be written to, or left out if it is outside of the world
+    chunk_view edit_view(UShortVec2 c_pos) {
+        if(!updating && chunk_grid::in_bounds(c_pos) && !chunks.find(c_pos))
+            create_chunk(c_pos);
+        chunk_view v = view(c_pos);
+        if(!updating && !chunks.find(c_pos))
+            v.around[4] = nullptr;
+        return v;
+    }
+
+    // Works out the shading masks in a box of tiles (max not included) again
+    void refresh_adjacency(IntVec2 min, IntVec2 max) {
+        for_each_span(min, max, [this](const chunk_span &s) {
+            // Copies of the terrain are made again next time they are looked at
+            if(!s.stored) {
+                forget_view(s.c_pos);
+                return;
+            }
+            chunk_view v = view(s.c_pos);
+            chunk * c = v.self();
+            for(int x = s.min.x;x<s.max.x;++x) {
+                for(int y = s.min.y;y<s.max.y;++y) {
+                    unsigned char adjacency = v.adjacency(x - s.c_pos.x*16, y - s.c_pos.y*16);
+                    if(c->adjacency.get(x%16, y%16) != adjacency) {
+                        c->dirty = true;
+                        c->adjacency.set(x%16, y%16, adjacency);
+                    }
+                }
+            }
+        });
+    }
+
+    // Sets many tiles at once, going through them a chunk at a time and working out the masks once a chunk
+    // Tiles set more than once end up as the last one given
+    void set_tiles(const vector<pair<IntVec2, tiles::tile>> &edits) {
+        if(updating) {
+            for(auto &edit : edits)
+                post({world_command::SET_TILE, edit.first, edit.second});
+            return;
+        }
+        vector<pair<unsigned int, unsigned int>> order; // Chunk index then where it is in edits
+        order.reserve(edits.size());
+        for(size_t i = 0;i<edits.size();++i) {
+            IntVec2 pos = edits[i].first;
+            if(pos.x<0 || pos.y<0 || pos.x>=CHUNK_COUNT*16 || pos.y>=CHUNK_COUNT*16)
+                continue;
+            order.push_back({(unsigned int)((pos.y/16)*CHUNK_COUNT + pos.x/16), (unsigned int)i});
+        }
+        sort(order.begin(), order.end());
+        for(size_t i = 0;i<order.size();) {
+            IntVec2 first = edits[order[i].second].first;
+            chunk_view v = edit_view({(unsigned short)(first.x/16), (unsigned short)(first.y/16)});
+            size_t end = i;
+            for(;end<order.size() && order[end].first == order[i].first;++end) {
+                const pair<IntVec2, tiles::tile> &edit = edits[order[end].second];
+                v.set(edit.first.x%16, edit.first.y%16, edit.second);
+            }
+            v.finish();
+            i = end;
+        }
+    }
+
+    // Walks the tiles a line from start to end (in tiles) passes through in order, calling fn(IntVec2, const tiles::tile &) on each
+    // until it returns true, which stops it on that tile and puts it in hit. Tiles outside of the world are void
+    template<typename F> bool cast_ray(Vector2 start, Vector2 end, F fn, IntVec2 &hit) {
+        IntVec2 pos = {(int)floor(start.x), (int)floor(start.y)};
+        IntVec2 last = {(int)floor(end.x), (int)floor(end.y)};
+        Vector2 d = {end.x - start.x, end.y - start.y};
+        IntVec2 step = {d.x > 0 ? 1 : -1, d.y > 0 ? 1 : -1};
+        // How far along the line the next column and row borders are, and how far apart they are, as fractions of the line
+        float delta_x = d.x != 0 ? fabs(1 / d.x) : INFINITY;
+        float delta_y = d.y != 0 ? fabs(1 / d.y) : INFINITY;
+        float next_x = d.x != 0 ? (d.x > 0 ? pos.x + 1 - start.x : start.x - pos.x) * delta_x : INFINITY;
+        float next_y = d.y != 0 ? (d.y > 0 ? pos.y + 1 - start.y : start.y - pos.y) * delta_y : INFINITY;
+        int steps = abs(last.x - pos.x) + abs(last.y - pos.y);
+
+        UShortVec2 c_pos = NO_VIEW;
+        chunk * c = nullptr;
+        for(int i = 0;;++i) {
+            tiles::tile t = tiles::VOID_TILE;
+            if(pos.x>=0 && pos.y>=0 && pos.x<=WORLD_SIZE && pos.y<=WORLD_SIZE) {
+                UShortVec2 tile_chunk = {(unsigned short)(pos.x/16), (unsigned short)(pos.y/16)};
+                if(!(tile_chunk == c_pos)) {
+                    c_pos = tile_chunk;
+                    c = get_chunk(c_pos, false);
+                }
+                t = c->get(pos.x%16, pos.y%16);
+            }
+            if(fn(pos, t)) {
+                hit = pos;
+                return true;
+            }
+            if(i == steps)
+                return false;
+            if(next_x < next_y) {
+                next_x += delta_x;
+                pos.x += step.x;
+            }
+            else {
+                next_y += delta_y;
+                pos.y += step.y;
+            }
+        }
+    }
+
+    // Neighbour offsets in the order the simulation visits them
+    static constexpr IntVec2 neighbors[4] = {
+        {1, 0},
+        {-1, 0},
+        {0, 1},
+        {0, -1}
+    };
+
+    // Reads a tile from the front buffer without creating anything
+    tiles::tile read_tile(IntVec2 pos) {
         if(pos.x<0 || pos.y<0 || pos.x>WORLD_SIZE || pos.y>WORLD_SIZE)
             return tiles::VOID_TILE;
 
-        auto c = chunkmap.find( (UShortVec2){ 
-            (unsigned short)(pos.x/16), 
-            (unsigned short)(pos.y/16) 
-        } );
+        chunk * c = chunks.find((UShortVec2){
+            (unsigned short)(pos.x/16),
+            (unsigned short)(pos.y/16)
+        });
 
-        if(c == chunkmap.end() || c->second[pos.x%16][pos.y%16].id == 0)
+        if(!c)
             return tiles::VOID_TILE;
 
-        return c->second[pos.x%16][pos.y%16];
+        return c->get(pos.x%16, pos.y%16);
     }
+    // Reads a tile for a worker from the chunks around sim chunk i, which is as far as the simulation ever looks
+    tiles::packed_tile read_near(size_t i, IntVec2 pos) const {
+        if(pos.x<0 || pos.y<0 || pos.x>WORLD_SIZE || pos.y>WORLD_SIZE)
+            return (tiles::packed_tile){tiles::ID::VOID, 0};
 
-    // Main update tile function
-    static void update_tile(chunk * c, IntVec2 pos, map<UShortVec2, chunk> * chunkmap, _player * Player) {
-        tiles::tile * tile = &c->content[pos.x%16][pos.y%16];
+        UShortVec2 c_pos = sim_chunks[i].first;
+        int dx = pos.x/16 - c_pos.x;
+        int dy = pos.y/16 - c_pos.y;
+        if(dx < -1 || dx > 1 || dy < -1 || dy > 1)
+            return (tiles::packed_tile){tiles::ID::VOID, 0};
 
-        // Lambdas for tile management
-        auto get_neighbor = [chunkmap, pos](IntVec2 p2) {
-            if(pos.x+p2.x<0 || pos.y+p2.y<0 || pos.x+p2.x>WORLD_SIZE || pos.y+p2.y>WORLD_SIZE)
-                return tiles::VOID_TILE;
+        chunk * c = sim_around[i][(dy + 1)*3 + dx + 1];
+        if(!c)
+            return (tiles::packed_tile){tiles::ID::VOID, 0};
 
-            auto c = chunkmap->find((UShortVec2){
-                (unsigned short)((pos.x+p2.x)/16),
-                (unsigned short)((pos.y+p2.y)/16)
-            });
+        return c->packed(pos.x%16, pos.y%16);
+    }
 
-            if(c == chunkmap->end())
-                return tiles::VOID_TILE;
+    // The side of a gas outlet it pushes gas out of this tick, picked at random from its open sides
+    bool outlet_target(size_t i, IntVec2 outlet, IntVec2 &target) const {
+        IntVec2 open[4];
+        int count = 0;
+        for(int n = 0;n<4;++n) {
+            if(tiles::is_air(read_near(i, outlet + neighbors[n]).id))
+                open[count++] = outlet + neighbors[n];
+        }
+        if(!count)
+            return false;
 
-            return c->second.content[(pos.x+p2.x)%16][(pos.y+p2.y)%16];
-        };
-        auto set_neighbor_mass = [chunkmap, pos](IntVec2 p2, float mass) {
-            chunk * c = &chunkmap->find((UShortVec2){
-                (unsigned short)((pos.x+p2.x)/16),
-                (unsigned short)((pos.y+p2.y)/16)
-            })->second;
-            c->content[(pos.x+p2.x)%16][(pos.y+p2.y)%16].mass = mass;
-        };
-        auto set_neighbor_id = [chunkmap, pos](IntVec2 p2, unsigned short id) {
-            chunk * c = &chunkmap->find((UShortVec2){
-                (unsigned short)((pos.x+p2.x)/16),
-                (unsigned short)((pos.y+p2.y)/16)
-            })->second;
-            c->content[(pos.x+p2.x)%16][(pos.y+p2.y)%16].id = id;
-        };
+        target = open[Random::Hash64(Random::OUTLET, outlet.x, outlet.y, sim_ticks) % count];
+        return true;
+    }
 
-        auto swap_neighbors = [set_neighbor_id, set_neighbor_mass, get_neighbor](IntVec2 pos_a, IntVec2 pos_b) {
-            tiles::tile a = get_neighbor(pos_a);
-            tiles::tile b = get_neighbor(pos_b);
-            set_neighbor_id(pos_a, b.id);
-            set_neighbor_mass(pos_a, b.mass);
-            set_neighbor_id(pos_b, a.id);
-            set_neighbor_mass(pos_b, a.mass);
+    unsigned char compute_adjacency(IntVec2 pos) {
+        unsigned char walls = 0;
+        unsigned char gas = 0;
+        for(int i = 0;i<4;++i) {
+            unsigned short id = get_tile(pos + neighbors[i]).id;
+            if(tiles::is_collidable(id))
+                walls |= 1 << i;
+            if(!gas && tiles::is_air(id))
+                gas = i + 1;
+        }
+        return walls | (gas << 4);
+    }
+    void update_adjacency(IntVec2 pos) {
+        if(pos.x<0 || pos.y<0)
+            return;
+        UShortVec2 c_pos = {(unsigned short)(pos.x/16), (unsigned short)(pos.y/16)};
+        chunk * c = chunks.find(c_pos);
+        if(c) {
+            unsigned char adjacency = compute_adjacency(pos);
+            if(c->adjacency.get(pos.x%16, pos.y%16) != adjacency) {
+                c->dirty = true;
+                c->adjacency.set(pos.x%16, pos.y%16, adjacency);
+            }
+        }
+        else
+            forget_view(c_pos);
+    }
+    // Recomputes every mask from scratch and counts the ones that were out of date, for debugging
+    int check_adjacency() {
+        int wrong = 0;
+        chunks.for_each([this, &wrong](UShortVec2 c_pos, chunk * c) {
+            for(int x = 0;x<16;++x) {
+                for(int y = 0;y<16;++y) {
+                    IntVec2 pos = {c_pos.x*16 + x, c_pos.y*16 + y};
+                    unsigned char walls = 0;
+                    unsigned char gas = 0;
+                    for(int i = 3;i>=0;--i) {
+                        tiles::tile t = get_tile(pos + neighbors[i]);
+                        walls |= tiles::is_collidable(t.id) << i;
+                        if(tiles::is_air(t.id))
+                            gas = i + 1;
+                    }
+                    if(c->adjacency.get(x, y) != (walls | (gas << 4)))
+                        ++wrong;
+                }
+            }
+        });
+        return wrong;
+    }
+
+    // Copies a chunk and the ring of tiles around it out of the front buffers
+    // Tiles outside of the world, or in unstored chunks that are not being simulated, act like solid ground
+    void gather_halo(size_t i, gas_kernel::halo &h, unsigned char ids[18][18]) const {
+        chunk * c = sim_chunks[i].second;
+        chunk * right = sim_around[i][5];
+        chunk * left = sim_around[i][3];
+        chunk * up = sim_around[i][7];
+        chunk * down = sim_around[i][1];
+
+        unsigned short masses[18][18] = {};
+        fill(&ids[0][0], &ids[0][0] + 18*18, tiles::ID::VOID);
+        tile_planes planes;
+        c->store.copy_to(planes);
+        for(int x = 0;x<16;++x) {
+            copy(planes.id[x], planes.id[x] + 16, &ids[x+1][1]);
+            copy(planes.mass[x], planes.mass[x] + 16, &masses[x+1][1]);
+        }
+        // Neighbours can be in any form, so their edges are read a tile at a time
+        auto edge = [&](chunk * n, int nx, int ny, int hx, int hy) {
+            tiles::packed_tile t = n->store.get(nx, ny);
+            ids[hx][hy] = t.id;
+            masses[hx][hy] = t.mass;
         };
+        for(int i = 0;i<16;++i) {
+            if(right)
+                edge(right, 0, i, 17, i+1);
+            if(left)
+                edge(left, 15, i, 0, i+1);
+            if(up)
+                edge(up, i, 0, i+1, 17);
+            if(down)
+                edge(down, i, 15, i+1, 0);
+        }
 
-        auto blend_neighbors_mass = [set_neighbor_mass, get_neighbor, set_neighbor_id] (IntVec2 pos_a, IntVec2 pos_b) {
-            tiles::tile a = get_neighbor(pos_a);
-            tiles::tile b = get_neighbor(pos_b);
-            if(a.id != b.id && a.id != tiles::ID::VACUMN && b.id != tiles::ID::VACUMN)
-                return;
+        for(int x = 0;x<18;++x) {
+            for(int y = 0;y<18;++y) {
+                bool air = tiles::is_air(ids[x][y]);
+                h.air[x][y] = air ? -1 : 0;
+                h.mass[x][y] = air && ids[x][y] != tiles::ID::VACUMN ? masses[x][y] : 0;
+            }
+        }
+    }
 
-            if(a.id == tiles::ID::VACUMN)
-                set_neighbor_id(pos_a, b.id);
-            if(b.id == tiles::ID::VACUMN)
-                set_neighbor_id(pos_b, a.id);
+    // Adds what the diffusion kernel leaves out (gas outlets and open doors) and works out the gas tile's new id
+    tiles::packed_tile finish_gas_tile(size_t c, IntVec2 pos, const gas_kernel::halo &h, const unsigned char ids[18][18], int hx, int hy, int flow) const {
+        int mass = h.mass[hx][hy] + flow;
+        int heaviest = 0;
+        unsigned char gas = tiles::ID::OXYGEN;
+        for(int i = 0;i<4;++i) {
+            int nx = hx + neighbors[i].x;
+            int ny = hy + neighbors[i].y;
+            unsigned char id = ids[nx][ny];
+
+            if(id == tiles::ID::GAS_OUTLET) {
+                IntVec2 target;
+                if(outlet_target(c, pos + neighbors[i], target) && target == pos)
+                    mass += OUTLET_FLOW * MASS_SCALE;
+            }
+            // An open door joins the tiles above and below it as if they where next to eachother
+            else if(id == tiles::ID::DOOR_OPEN && neighbors[i].x == 0) {
+                tiles::packed_tile n = read_near(c, pos + neighbors[i] + neighbors[i]);
+                if(tiles::is_air(n.id)) {
+                    int n_mass = n.id == tiles::ID::VACUMN ? 0 : n.mass;
+                    mass += (n_mass - h.mass[hx][hy]) / GAS_FLOW;
+                    if(n.id != tiles::ID::VACUMN && n_mass > heaviest) {
+                        heaviest = n_mass;
+                        gas = n.id;
+                    }
+                }
+            }
+            else if(h.air[nx][ny] && id != tiles::ID::VACUMN && h.mass[nx][ny] > heaviest) {
+                heaviest = h.mass[nx][ny];
+                gas = id;
+            }
+        }
+        mass = min(max(mass, 0), MAX_MASS);
+
+        // Gas that is spread too thin disappears, vacumn fills with whatever flowed into it
+        if(mass < tiles::pack_mass(0.1f))
+            return (tiles::packed_tile){tiles::ID::VACUMN, 0};
+        unsigned char id = ids[hx][hy];
+        if(id == tiles::ID::VACUMN)
+            id = gas;
+        return (tiles::packed_tile){id, (unsigned short)mass};
+    }
 
-            float mass = (a.mass + b.mass)/2;
-            set_neighbor_mass(pos_a, mass);
-            set_neighbor_mass(pos_b, mass);
-        };
+    // Posts a command to be applied once the running tick is swapped in, or at the start of the next tick if none is running
+    // Commands are what input and gameplay change the world with, so the simulation only ever sees a finished state
+    void post(const world_command &command) {
+        if(!commands.push(command)) {
+            // Only when a whole queue of commands piled up during one tick
+            finish_tick();
+            apply_commands();
+            commands.push(command);
+        }
 
-        IntVec2 neighbor;
-        IntVec2 neighbors[4] = {
-            {1, 0},
-            {-1, 0},
-            {0, 1},
-            {0, -1}
-        };
-        int i = 0;
-        float old = tile->mass;
-        switch(tile->id) {
-            case tiles::ID::GAS_OUTLET:
-                for(i=0;i<5;++i) {
-                    if(i==4)
-                        return;
-                    if(get_neighbor(neighbors[i]).id == tiles::ID::VACUMN || get_neighbor(neighbors[i]).id == tiles::ID::OXYGEN)
-                        break;
-                }
-                
-                while(get_neighbor(neighbor).id != tiles::ID::VACUMN && get_neighbor(neighbor).id != tiles::ID::OXYGEN)
-                    neighbor = neighbors[rand()%4];
+        if(command.type == world_command::SET_TILE)
+            posted[posted_key(command.pos)] = {command.tile, 0, true, false};
+        else if(command.type == world_command::SET_MASS) {
+            posted_edit &edit = posted[posted_key(command.pos)];
+            edit.mass = command.tile.mass;
+            edit.set_mass = true;
+        }
+    }
+    void apply_commands() {
+        posted.clear();
+        world_command command;
+        while(commands.pop(command)) {
+            IntVec2 pos = command.pos;
+            // Input can point past the edges, those commands have no tile to change
+            if(pos.x<0 || pos.y<0 || pos.x>=WORLD_SIZE || pos.y>=WORLD_SIZE)
+                continue;
+            switch(command.type) {
+                case world_command::SET_TILE:
+                    set_tile(
+                        (UShortVec2){(unsigned short)(pos.x%16), (unsigned short)(pos.y%16)},
+                        (UShortVec2){(unsigned short)(pos.x/16), (unsigned short)(pos.y/16)},
+                        command.tile
+                    );
+                    break;
+                case world_command::SET_MASS:
+                    set_mass(pos, command.tile.mass);
+                    break;
+                case world_command::INTERACT:
+                    interact(pos);
+                    break;
+            }
+        }
+    }
 
-                set_neighbor_id(neighbor, tiles::ID::OXYGEN);
-                set_neighbor_mass(neighbor, get_neighbor(neighbor).mass + 10);
-                break;
-            case tiles::ID::DOOR_PANEL_A:
-            case tiles::ID::DOOR_PANEL_B:
-                if(Player->select == pos && Player->interact) {
-                    for(int x = -4; x < 5;++x) {
-                        if(get_neighbor((IntVec2){x, 0}).id == tiles::ID::DOOR)
-                            set_neighbor_id((IntVec2){x, 0}, tiles::ID::DOOR_OPEN);
-                        else if(get_neighbor((IntVec2){x, 0}).id == tiles::ID::DOOR_OPEN)
-                            set_neighbor_id((IntVec2){x, 0}, tiles::ID::DOOR);
+    // A door panel opens or closes the doors in the row next to it
+    void interact(IntVec2 panel) {
+        unsigned short id = read_tile(panel).id;
+        if(id != tiles::ID::DOOR_PANEL_A && id != tiles::ID::DOOR_PANEL_B)
+            return;
+
+        vector<pair<IntVec2, tiles::tile>> doors;
+        for_each_span(panel - (IntVec2){4, 0}, panel + (IntVec2){5, 1}, [&doors](const chunk_span &s) {
+            for(int x = s.min.x;x<s.max.x;++x) {
+                tiles::tile t = s.c->get(x%16, s.min.y%16);
+                if(t.id == tiles::ID::DOOR)
+                    t.id = tiles::ID::DOOR_OPEN;
+                else if(t.id == tiles::ID::DOOR_OPEN)
+                    t.id = tiles::ID::DOOR;
+                else
+                    continue;
+                doors.push_back({{x, s.min.y}, t});
+            }
+        });
+        set_tiles(doors);
+    }
+
+    // Update operations
+    vector<chunk *> awake_chunks;
+
+    void wake(chunk * c) {
+        c->idle_ticks = 0;
+        if(c->awake)
+            return;
+        c->awake = true;
+        awake_chunks.push_back(c);
+    }
+
+    // A tick runs on the workers while the main thread renders and takes input
+    // The chunks' tiles are the front buffers, the world as of tick sim_ticks, and nothing writes them until the tick is swapped in,
+    // so the workers and the main thread can both read them without locking. Edits from the main thread wait in commands until then
+    unique_ptr<thread_pool> workers;
+    unsigned int thread_count = SIM_THREADS;
+    bool updating = false;
+    unsigned long long sim_ticks = 0; // Ticks swapped in, which is the tick the front buffers are from
+
+    // The chunks being simulated, the back buffer each one is written to and whether anything in it changed
+    vector<pair<UShortVec2, chunk *>> sim_chunks;
+    vector<tile_planes> back_buffers;
+    vector<char> changed;
+
+    // The 3x3 chunks around each sim chunk, found before the tick starts so the workers never look anything up
+    vector<array<chunk *, 9>> sim_around;
+
+    // Terrain copies of the unstored chunks being simulated this tick, kept from tick to tick to be filled again
+    vector<unique_ptr<chunk>> sim_terrain;
+    size_t sim_terrain_used = 0;
+    unordered_map<unsigned int, chunk *> sim_terrain_at; // By index in the chunk grid
+
+    // Changes from the main thread waiting for the running tick to be swapped in
+    spsc_queue<world_command, COMMAND_QUEUE_SIZE> commands;
+
+    // What the waiting commands leave each tile they touch as, so get_tile does not have to search the queue
+    struct posted_edit {
+        tiles::tile tile;
+        float mass;
+        bool set_tile; // Otherwise the tile is whatever is there when the commands are applied
+        bool set_mass;
+    };
+    unordered_map<unsigned int, posted_edit> posted;
+    static unsigned int posted_key(IntVec2 pos) {
+        return pos.y*65536 + pos.x;
+    }
+
+    // Picked once for the CPU the game runs on
+    gas_kernel::kernel diffuse = gas_kernel::select();
+
+    // Chunks only read the front buffers and write their own back buffer, so any number of them can be updated at once
+    void update_chunk(size_t i) {
+        PROFILE_ZONE("Update chunk");
+        UShortVec2 c_pos = sim_chunks[i].first;
+        chunk * c = sim_chunks[i].second;
+
+        gas_kernel::halo h;
+        unsigned char ids[18][18];
+        gather_halo(i, h, ids);
+
+        short flow[16][16];
+        diffuse(h, flow);
+
+        tile_planes &back = back_buffers[i];
+        c->store.copy_to(back);
+        bool change = false;
+        for(unsigned short x = 0;x<16;++x) {
+            for(unsigned short y = 0;y<16;++y) {
+                if(!h.air[x+1][y+1])
+                    continue;
+                tiles::packed_tile t = finish_gas_tile(i, (IntVec2){(c_pos.x*16) + x, (c_pos.y*16) + y}, h, ids, x+1, y+1, flow[x][y]);
+                if(t.id != back.id[x][y] || t.mass != back.mass[x][y])
+                    change = true;
+                back.id[x][y] = t.id;
+                back.mass[x][y] = t.mass;
+            }
+        }
+        changed[i] = change;
+    }
+    void swap_buffers() {
+        for(size_t i = 0;i<sim_chunks.size();++i) {
+            UShortVec2 c_pos = sim_chunks[i].first;
+            chunk * c = sim_chunks[i].second;
+            // A terrain copy that nothing moved into is dropped, one that changed is stored from here on
+            if(c != chunks.slots[c_pos.y*CHUNK_COUNT + c_pos.x].get()) {
+                if(!changed[i])
+                    continue;
+                c = create_chunk(c_pos);
+            }
+            // Chunks sleep once they stop changing and wake up again when they get pulled into a tick and change
+            // and are only packed down again once they are asleep
+            if(changed[i]) {
+                c->store.assign(back_buffers[i]);
+                c->dirty = true;
+                wake(c);
+            }
+            else if(c->awake && ++c->idle_ticks >= SLEEP_TICKS) {
+                c->awake = false;
+                c->store.compact();
+            }
+        }
+        awake_chunks.erase(remove_if(awake_chunks.begin(), awake_chunks.end(), [](chunk * c) { return !c->awake; }), awake_chunks.end());
+
+        updating = false;
+        apply_commands();
+        ++sim_ticks;
+    }
+    // Waits for the running tick and swaps it in
+    void finish_tick() {
+        if(!updating)
+            return;
+        {
+            PROFILE_ZONE("Wait for workers");
+            workers->wait();
+        }
+        PROFILE_ZONE("Swap buffers");
+        swap_buffers();
+    }
+    void tick_update(_player * Player) {
+        PROFILE_ZONE("Tick");
+        finish_tick();
+        {
+            PROFILE_ZONE("Commands");
+            apply_commands();
+        }
+        if(Player)
+            page_focus = {(int)(Player->position.x/50), (int)(Player->position.y/50)};
+        {
+            PROFILE_ZONE("Paging");
+            page();
+        }
+
+        // Collect the awake chunks and their neighbours, so mass moving over a border is worked out on both sides
+        profiler::scope scheduling("Schedule");
+        sim_chunks.clear();
+        sim_terrain_at.clear();
+        sim_terrain_used = 0;
+        for(chunk * c : awake_chunks) {
+            UShortVec2 c_pos = c->position;
+            schedule(c_pos);
+            schedule((UShortVec2){(unsigned short)(c_pos.x + 1), c_pos.y});
+            schedule((UShortVec2){(unsigned short)(c_pos.x - 1), c_pos.y});
+            schedule((UShortVec2){c_pos.x, (unsigned short)(c_pos.y + 1)});
+            schedule((UShortVec2){c_pos.x, (unsigned short)(c_pos.y - 1)});
+        }
+        back_buffers.resize(sim_chunks.size());
+        changed.resize(sim_chunks.size());
+
+        // The workers read the chunks around every chunk they update, so any that are still saved records get decoded here first
+        // Neighbours that are not stored are read from their terrain copy if they are being simulated
+        sim_around.resize(sim_chunks.size());
+        for(size_t i = 0;i<sim_chunks.size();++i) {
+            UShortVec2 c_pos = sim_chunks[i].first;
+            for(int dy = -1;dy<=1;++dy) {
+                for(int dx = -1;dx<=1;++dx) {
+                    UShortVec2 pos = {(unsigned short)(c_pos.x + dx), (unsigned short)(c_pos.y + dy)};
+                    chunk * c = need(pos);
+                    if(!c && chunk_grid::in_bounds(pos)) {
+                        auto it = sim_terrain_at.find(pos.y*CHUNK_COUNT + pos.x);
+                        if(it != sim_terrain_at.end())
+                            c = it->second;
                     }
-                    Player->interact = false;
-                }
-                break;
-            case tiles::ID::DOOR_OPEN:
-                // If the tile above and below the door is air
-                if(tiles::is_air(get_neighbor((IntVec2){0, 1}).id) && tiles::is_air(get_neighbor((IntVec2){0, -1}).id)) {
-                    // Average the two tiles masses together as if they where next to eachother
-                    blend_neighbors_mass((IntVec2){0, 1}, (IntVec2){0, -1});
-                }
-                break;
-            case tiles::ID::OXYGEN:
-                if(tile->mass < 0.1) {
-                    tile->mass = 0;
-                    tile->id = tiles::ID::VACUMN;
-                }
-            case tiles::ID::VACUMN:
-                if(tile->id == tiles::ID::VACUMN)
-                    tile->mass = 0;
-
-                neighbor = (IntVec2){0, -1};
-                if(tiles::is_air(get_neighbor(neighbor).id) && get_neighbor(neighbor).mass > tile->mass) {
-                    tile->mass = float(tile->mass + get_neighbor(neighbor).mass)/2.0f;
-                    set_neighbor_mass(neighbor, get_neighbor(neighbor).mass - (tile->mass-old));
-                    if(tile->id == tiles::ID::VACUMN)
-                        tile->id = get_neighbor(neighbor).id;
+                    sim_around[i][(dy + 1)*3 + dx + 1] = c;
                 }
-                neighbor = (IntVec2){0, 1};
-                old = tile->mass;
-                if(tiles::is_air(get_neighbor(neighbor).id) && get_neighbor(neighbor).mass > tile->mass) {
-                    tile->mass = float((tile->mass) + get_neighbor(neighbor).mass)/2.0f;
-                    set_neighbor_mass(neighbor, get_neighbor(neighbor).mass - (tile->mass-old));
-                    if(tile->id == tiles::ID::VACUMN)
-                        tile->id = get_neighbor(neighbor).id;
-                }
-                neighbor = (IntVec2){-1, 0};
-                old = tile->mass;
-                if(tiles::is_air(get_neighbor(neighbor).id) && get_neighbor(neighbor).mass > tile->mass) {
-                    tile->mass = float((tile->mass) + get_neighbor(neighbor).mass)/2.0f;
-                    set_neighbor_mass(neighbor, get_neighbor(neighbor).mass - (tile->mass-old));
-                    if(tile->id == tiles::ID::VACUMN)
-                        tile->id = get_neighbor(neighbor).id;
-                }
-                neighbor = (IntVec2){1, 0};
-                old = tile->mass;
-                if(tiles::is_air(get_neighbor(neighbor).id) && get_neighbor(neighbor).mass > tile->mass) {
-                    tile->mass = float((tile->mass) + get_neighbor(neighbor).mass)/2.0f;
-                    set_neighbor_mass(neighbor, get_neighbor(neighbor).mass - (tile->mass-old));
-                    if(tile->id == tiles::ID::VACUMN)
-                        tile->id = get_neighbor(neighbor).id;
-                }
-            default:
+            }
+        }
+
+        scheduling.end();
+
+        if(!workers)
+            workers = make_unique<thread_pool>(thread_count);
+        updating = true;
+        PROFILE_ZONE("Dispatch");
+        workers->dispatch(sim_chunks.size(), [this](size_t i) { update_chunk(i); }, SIM_BATCH);
+    }
+    // Neighbours of awake chunks that are not stored are simulated on a copy of their terrain,
+    // and only stored in swap_buffers if gas actually moved into them
+    void schedule(UShortVec2 c_pos) {
+        if(!chunk_grid::in_bounds(c_pos))
+            return;
+        chunk * c = need(c_pos);
+        if(!c) {
+            unsigned int index = c_pos.y*CHUNK_COUNT + c_pos.x;
+            if(sim_terrain_at.count(index))
                 return;
+            if(sim_terrain_used == sim_terrain.size())
+                sim_terrain.push_back(make_unique<chunk>(null_chunk));
+            c = sim_terrain[sim_terrain_used++].get();
+            fill_terrain(c, c_pos);
+            sim_terrain_at[index] = c;
+            sim_chunks.push_back({c_pos, c});
+            return;
         }
+        if(c->scheduled == sim_ticks + 1)
+            return;
+        c->scheduled = sim_ticks + 1;
+        sim_chunks.push_back({c_pos, c});
+    }
+    void set_threads(unsigned int count) {
+        finish_tick();
+        thread_count = count;
+        if(workers)
+            workers->resize(count);
+    }
+    void stop_update_thread() {
+        finish_tick();
+        workers.reset();
+        wait_for_save();
+        collect_decoded(true);
     }
 
-    // Update operations
-    thread updater_thread;
-    static void run_updates(map<UShortVec2, chunk> * chunkmap, _player * Player) {
-        for(auto &chunk : *chunkmap) {
-            for(unsigned short x = 0;x<16;++x) {
-                for(unsigned short y = 0;y<16;++y) {
-                    update_tile( 
-                        &chunk.second,
-                        (IntVec2){
-                            (chunk.first.x*16) + x,
-                            (chunk.first.y*16) + y
-                        },
-                        chunkmap,
-                        Player
-                    );
+    // Saving
+    thread saver;
+    struct {
+        size_t regions = 0;
+        size_t chunks = 0;
+        size_t bytes = 0;
+        size_t kept = 0;   // Clean chunks whose records were copied from the last save instead of encoded again
+        size_t copied = 0; // Unchanged regions copied across from the last save's folder
+        double snapshot_ms = 0;
+        double write_ms = 0;
+        bool ok = true;
+    } save_stats;
+
+    // Everything a region file needs, copied so it can be written while the game keeps changing the world
+    struct region_snapshot {
+        int x, y;
+        vector<pair<int, region_file::chunk_data>> chunks;
+        vector<pair<int, vector<unsigned char>>> records; // Chunks that were never decoded are copied as they are
+        vector<int> kept; // Clean chunks, their records are copied from the region file in saved_dir
+    };
+    string saved_dir; // The folder whose region files hold every chunk that is not dirty, empty until the world is saved or loaded
+
+    // Writes every region with a chunk changed since the last save on a background thread
+    // Only the dirty chunks are copied here, clean ones keep the records they already have in the last save,
+    // and saving to a different folder copies the regions with nothing changed across as they are
+    void save(const string &dir) {
+        wait_for_save();
+        PROFILE_ZONE("Save snapshot");
+        auto start = chrono::steady_clock::now();
+
+        int count = (CHUNK_COUNT + REGION_SIZE - 1) / REGION_SIZE;
+        vector<char> changed_regions(count * count);
+        for(size_t i = 0;i<chunks.slots.size();++i) {
+            chunk * c = chunks.slots[i].get();
+            if((c && c->dirty) || (chunks.is_pending(i) && chunks.pending_dirty[i]))
+                changed_regions[((i / CHUNK_COUNT) / REGION_SIZE)*count + (i % CHUNK_COUNT) / REGION_SIZE] = 1;
+        }
+
+        auto snapshots = make_shared<vector<region_snapshot>>();
+        auto unchanged = make_shared<vector<IntVec2>>();
+        string source = saved_dir;
+        std::error_code error;
+        for(int r = 0;r<count*count;++r) {
+            region_snapshot region = {r % count, r / count, {}, {}, {}};
+            if(!changed_regions[r]) {
+                if(!source.empty() && source != dir)
+                    unchanged->push_back({region.x, region.y});
+                continue;
+            }
+            bool keep = !source.empty() && filesystem::exists(region_file::region_path(source, region.x, region.y), error);
+            for(int k = 0;k<REGION_SIZE*REGION_SIZE;++k) {
+                UShortVec2 pos = {(unsigned short)(region.x*REGION_SIZE + k % REGION_SIZE), (unsigned short)(region.y*REGION_SIZE + k / REGION_SIZE)};
+                if(!chunk_grid::in_bounds(pos))
+                    continue;
+                size_t i = pos.y*CHUNK_COUNT + pos.x;
+                if(chunk * c = chunks.slots[i].get()) {
+                    if(keep && !c->dirty) {
+                        region.kept.push_back(k);
+                        continue;
+                    }
+                    region_file::chunk_data d;
+                    d.flags = c->awake ? region_file::AWAKE : 0;
+                    d.biome = c->biome;
+                    c->copy_to(d);
+                    region.chunks.push_back({k, d});
+                    c->dirty = false;
+                }
+                else if(chunks.is_pending(i)) {
+                    region.records.push_back({k, vector<unsigned char>(chunks.pending[i], chunks.pending[i] + chunks.pending_size[i])});
+                    chunks.pending_dirty[i] = 0;
                 }
             }
+            snapshots->push_back(std::move(region));
         }
-        return;
+
+        region_file::world_header header;
+        header.world_size = WORLD_SIZE;
+        header.seed = Random::seed;
+        header.sim_ticks = sim_ticks;
+
+        save_stats = {};
+        save_stats.regions = snapshots->size();
+        save_stats.snapshot_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        saved_dir = dir;
+
+        saver = thread([this, snapshots, unchanged, source, dir, header]() {
+            profiler::name_thread("Saver");
+            PROFILE_ZONE("Write regions");
+            auto start = chrono::steady_clock::now();
+            std::error_code error;
+            filesystem::create_directories(dir, error);
+
+            vector<unsigned char> bytes;
+            bool ok = true;
+            for(region_snapshot &region : *snapshots) {
+                region_file::region_header h;
+                h.x = region.x;
+                h.y = region.y;
+                bytes.assign(sizeof(h), 0);
+                for(auto &c : region.chunks) {
+                    h.index[c.first].offset = bytes.size();
+                    region_file::encode(c.second, bytes);
+                    h.index[c.first].size = bytes.size() - h.index[c.first].offset;
+                }
+                for(auto &r : region.records) {
+                    h.index[r.first] = {(unsigned int)bytes.size(), (unsigned int)r.second.size()};
+                    bytes.insert(bytes.end(), r.second.begin(), r.second.end());
+                }
+                if(!region.kept.empty()) {
+                    // The old file is mapped, so this still works when it is about to be replaced
+                    region_file::mapping m = region_file::map(region_file::region_path(source, region.x, region.y));
+                    region_file::region_header old;
+                    bool valid = m.size >= sizeof(old);
+                    if(valid)
+                        memcpy(&old, m.data, sizeof(old));
+                    valid = valid && memcmp(old.magic, "GRGN", 4) == 0 && old.version == SAVE_VERSION && old.region_size == REGION_SIZE;
+                    for(int k : region.kept) {
+                        region_file::index_entry e = valid ? old.index[k] : region_file::index_entry{0, 0};
+                        if(!e.offset || (size_t)e.offset + e.size > m.size) {
+                            ok = false;
+                            continue;
+                        }
+                        h.index[k] = {(unsigned int)bytes.size(), e.size};
+                        bytes.insert(bytes.end(), m.data + e.offset, m.data + e.offset + e.size);
+                    }
+                    region_file::unmap(m);
+                }
+                memcpy(bytes.data(), &h, sizeof(h));
+                ok &= region_file::write(region_file::region_path(dir, region.x, region.y), bytes);
+                save_stats.chunks += region.chunks.size() + region.records.size();
+                save_stats.kept += region.kept.size();
+                save_stats.bytes += bytes.size();
+            }
+
+            // Nothing in these changed since the last save, which went to another folder
+            for(IntVec2 r : *unchanged) {
+                string from = region_file::region_path(source, r.x, r.y);
+                if(!filesystem::exists(from, error))
+                    continue;
+                string to = region_file::region_path(dir, r.x, r.y);
+                filesystem::copy_file(from, to + ".tmp", filesystem::copy_options::overwrite_existing, error);
+                ok &= !error && rename((to + ".tmp").c_str(), to.c_str()) == 0;
+                save_stats.copied += !error;
+            }
+
+            bytes.assign((const unsigned char *)&header, (const unsigned char *)&header + sizeof(header));
+            ok &= region_file::write(region_file::world_path(dir), bytes);
+            save_stats.ok = ok;
+            save_stats.write_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        });
     }
-    void tick_update(_player * Player) {
-        if(updater_thread.joinable())
-            updater_thread.join();
-        updater_thread = thread(run_updates, &chunkmap, Player);
+    void wait_for_save() {
+        if(saver.joinable())
+            saver.join();
     }
-    void stop_update_thread() {
-        updater_thread.join();
+
+    // Loads a saved world into a fresh world_map, the terrain is generated again from the seed and the saved chunks
+    // are mapped and only decoded when they are first looked up. Returns false if there is no usable save
+    bool load(const string &dir) {
+        ifstream file(region_file::world_path(dir), ios::binary);
+        region_file::world_header header;
+        if(!file.is_open() || !file.read((char *)&header, sizeof(header)))
+            return false;
+        if(memcmp(header.magic, "GWLD", 4) != 0 || header.version != SAVE_VERSION || header.world_size != WORLD_SIZE)
+            return false;
+
+        Random::init(header.seed);
+        generate();
+        sim_ticks = header.sim_ticks;
+        saved_dir = dir;
+
+        chunks.prepare_pending();
+        vector<UShortVec2> awake;
+
+        std::error_code error;
+        for(auto &entry : filesystem::directory_iterator(dir, error)) {
+            if(entry.path().extension() != ".region")
+                continue;
+            region_file::mapping m = region_file::map(entry.path().string());
+            region_file::region_header h;
+            if(m.size < sizeof(h)) {
+                region_file::unmap(m);
+                continue;
+            }
+            memcpy(&h, m.data, sizeof(h));
+            if(memcmp(h.magic, "GRGN", 4) != 0 || h.version != SAVE_VERSION || h.region_size != REGION_SIZE) {
+                region_file::unmap(m);
+                continue;
+            }
+
+            for(int k = 0;k<REGION_SIZE*REGION_SIZE;++k) {
+                region_file::index_entry e = h.index[k];
+                UShortVec2 pos = {(unsigned short)(h.x*REGION_SIZE + k % REGION_SIZE), (unsigned short)(h.y*REGION_SIZE + k / REGION_SIZE)};
+                if(!e.offset || (size_t)e.offset + e.size > m.size || !chunk_grid::in_bounds(pos))
+                    continue;
+                size_t i = pos.y*CHUNK_COUNT + pos.x;
+                if(chunks.slots[i] || chunks.pending[i])
+                    continue;
+                chunks.pending[i] = m.data + e.offset;
+                chunks.pending_size[i] = e.size;
+                chunks.pending_file[i] = chunks.files.size();
+                ++chunks.pending_count;
+                ++m.users;
+                if(m.data[e.offset] & region_file::AWAKE)
+                    awake.push_back(pos);
+            }
+            if(m.users)
+                chunks.files.push_back(m);
+            else
+                region_file::unmap(m);
+        }
+
+        // Gas that was still moving carries on straight away
+        for(UShortVec2 pos : awake)
+            if(chunk * c = chunks.find(pos))
+                wake(c);
+        return true;
     }
 
+    // Rendering caches
+    chunk_cache chunk_textures;
+    light_map light;
+    unsigned long long wall_changes = 0; // Bumped whenever a tile starts or stops letting light through
+    IntVec2 last_wall_change = {0, 0};
+    unsigned long long solid_changes = 0; // Bumped whenever a tile starts or stops being collided with
+    IntVec2 last_solid_change = {0, 0};
+
     // How many extra tiles to render
     //                      left  right  top  bottom
     Vector4 r_padding = {  2,     2,    2,    9};
 
-    void render_tile(UShortVec2 pos, chunk * c, UShortVec2 c_pos, int x, int y, int tilex, int tiley, float size, float scale, float modx, float mody) {
-        tiles::tile tile = get_tile_c(pos, c);
-        unsigned char brightness = 255;
-        float r = PI - atan2(x, y);
-        float distance = dist((Vector2){0, 0.75}, (Vector2){float(x), float(y)});
-
-        if (LIMIT_LIGHTING && distance > max_light_dist) {
-            brightness = 255 - (DARKNESS*2);
-            if(tiles::is_transparent(tile.id) && brightness > 255 - (DARKNESS*2) && round(distance) == max_light_dist-1) 
-                brightness = 255 - DARKNESS;
-        }
-        else {
-            for(float d = 0; d < distance; d+=0.45) {
-                if(!tiles::is_transparent(get_tile_c_safe({ (int)(tilex + sin(r)*d + 0.5), (int)(tiley - cos(r)*d + 1) }, c_pos, c).id) ) {
-                    brightness-=DARKNESS;
-                    if(brightness <= 255 - (DARKNESS*2))
-                        break;
+    // Draws a tile, leaving out the tile itself if it is already baked into its chunk's texture
+    void render_tile(UShortVec2 pos, const chunk_view &v, int x, int y, int tilex, int tiley, float size, float scale, float modx, float mody, bool baked) {
+        tiles::tile tile = v.get(pos.x, pos.y);
+        unsigned char brightness = 255 - DARKNESS*light.shadow((IntVec2){tilex + x, tiley + y});
+        Vector2 offset = {(x * size) - (modx * size), (y * size) - (mody * size)};
+        bool selected = 
+            mouse->x - GetRenderWidth()/2 > (x * size) - (modx * size) && mouse->x - GetRenderWidth()/2 < ((x+1) * size) - (modx * size) &&
+            GetRenderHeight()/2 - mouse->y > ((y-1) * size) - (mody * size) && GetRenderHeight()/2 - mouse->y < (y * size) - (mody * size);
+
+        unsigned char adjacency = v.self()->adjacency.get(pos.x, pos.y);
+        const int angles[4] = {0, 180, 90, 270};
+        int wall[4];
+        int i=0;
+        tiles::tile gas = tiles::VOID_TILE;
+        if(tiles::is_air(tile.id)) {
+            for(int side = 0;side<4;++side) {
+                if(adjacency & (1 << side)) {
+                    wall[i] = angles[side];
+                    ++i;
                 }
             }
         }
-            
-        if(tiles::is_air(tile.id)) {
-            int wall[4];
-            int i=0;
-            if(tiles::is_collidable(get_tile_c_safe({tilex + x + 1, tiley + y}, c_pos, c).id)) {
-                wall[i] = 0;
-                ++i;
-            }
-            if(tiles::is_collidable(get_tile_c_safe({tilex + x - 1, tiley + y}, c_pos, c).id)) {
-                wall[i] = 180;
-                ++i;
-            }
-            if(tiles::is_collidable(get_tile_c_safe({tilex + x, tiley + y + 1}, c_pos, c).id)) {
-                wall[i] = 90;
-                ++i;
-            }
-            if(tiles::is_collidable(get_tile_c_safe({tilex + x, tiley + y - 1}, c_pos, c).id)) {
-                wall[i] = 270;
-                ++i;
-            }
-            tiles::draw_tile( 
-                tile,
-                {(x * size) - (modx * size), (y * size) - (mody * size)},
-                scale,
-                (Color){brightness, brightness, brightness, 255},
-                wall,
-                i,
-                mouse->x - GetRenderWidth()/2 > (x * size) - (modx * size) && mouse->x - GetRenderWidth()/2 < ((x+1) * size) - (modx * size) &&
-                GetRenderHeight()/2 - mouse->y > ((y-1) * size) - (mody * size) && GetRenderHeight()/2 - mouse->y < (y * size) - (mody * size)
-            );
-        }
-        else if(tiles::is_not_airtight(tile.id)) {
-            if(brightness > 255 - (DARKNESS*2))
-                brightness = 265 - (DARKNESS*2);
-            tiles::tile gas = tiles::VOID_TILE;
-            if(tiles::is_air(get_tile_c_safe({tilex + x + 1, tiley + y}, c_pos, c).id))
-                gas = get_tile_c_safe({tilex + x + 1, tiley + y}, c_pos, c);
-            else if(tiles::is_air(get_tile_c_safe({tilex + x - 1, tiley + y}, c_pos, c).id))
-                gas = get_tile_c_safe({tilex + x - 1, tiley + y}, c_pos, c);
-            else if(tiles::is_air(get_tile_c_safe({tilex + x, tiley + y + 1}, c_pos, c).id))
-                gas = get_tile_c_safe({tilex + x, tiley + y + 1}, c_pos, c);
-            else if(tiles::is_air(get_tile_c_safe({tilex + x, tiley + y - 1}, c_pos, c).id))
-                gas = get_tile_c_safe({tilex + x, tiley + y - 1}, c_pos, c);
-            tiles::draw_tile( 
-                tile,
-                {(x * size) - (modx * size), (y * size) - (mody * size)},
-                scale,
-                (Color){brightness, brightness, brightness, 255},
-                {},
-                0,
-                mouse->x - GetRenderWidth()/2 > (x * size) - (modx * size) && mouse->x - GetRenderWidth()/2 < ((x+1) * size) - (modx * size) &&
-                GetRenderHeight()/2 - mouse->y > ((y-1) * size) - (mody * size) && GetRenderHeight()/2 - mouse->y < (y * size) - (mody * size),
-                gas
-            );
-        }
         else {
             if(brightness > 255 - (DARKNESS*2))
                 brightness = 265 - (DARKNESS*2);
-            tiles::draw_tile( 
-                tile,
-                {(x * size) - (modx * size), (y * size) - (mody * size)},
-                scale,
-                (Color){brightness, brightness, brightness, 255},
-                {},
-                0,
-                mouse->x - GetRenderWidth()/2 > (x * size) - (modx * size) && mouse->x - GetRenderWidth()/2 < ((x+1) * size) - (modx * size) &&
-                GetRenderHeight()/2 - mouse->y > ((y-1) * size) - (mody * size) && GetRenderHeight()/2 - mouse->y < (y * size) - (mody * size)
+            if(tiles::is_not_airtight(tile.id) && adjacency >> 4)
+                gas = v.get(pos.x + neighbors[(adjacency >> 4) - 1].x, pos.y + neighbors[(adjacency >> 4) - 1].y);
+        }
+
+        if(!baked) {
+            tiles::draw_tile(tile, offset, scale, (Color){brightness, brightness, brightness, 255}, wall, i, selected, gas);
+            return;
+        }
+
+        // Darkening the baked tile with black is the same as tinting it grey
+        if(!selected && brightness < 255 && tile.id != tiles::ID::VOID)
+            DrawRectangleRec(
+                {GetRenderWidth()/2.0f + offset.x, GetRenderHeight()/2.0f - offset.y, size + 0.01f, size + 0.01f},
+                (Color){0, 0, 0, (unsigned char)(255 - brightness)}
             );
+        tiles::draw_overlays(tile, offset, scale, wall, i, selected, gas);
+    }
+
+    // Draws a chunk's tiles at sprite size with tile (0, 0) at the bottom left, for the chunk cache
+    void bake_chunk(chunk * c) {
+        float sprite = tiles::sprites[1].width;
+        for(unsigned short rel_x = 0; rel_x < 16; ++rel_x) {
+            for(unsigned short rel_y = 0; rel_y < 16; ++rel_y) {
+                tiles::draw_base(get_tile_c({rel_x, rel_y}, c), {rel_x * sprite, (15 - rel_y) * sprite}, 1, WHITE);
+            }
         }
     }
 
@@ -597,6 +2128,19 @@ class world_map {
         int tilew = ceil(GetRenderWidth()/size);
         int tileh = ceil(GetRenderHeight()/size);
 
+        // Light comes from the tile the player stands in
+        profiler::scope lighting("Lighting");
+        light.update(
+            (IntVec2){tilex, tiley + 1},
+            LIMIT_LIGHTING ? max_light_dist : UNLIMITED_LIGHT_DIST,
+            wall_changes,
+            last_wall_change,
+            [this](IntVec2 pos) { return tiles::is_transparent(get_tile(pos).id); }
+        );
+        lighting.end();
+
+        chunk_textures.next_frame();
+
         // Pre-define rendering vars
         int x;
         int y;
@@ -606,8 +2150,25 @@ class world_map {
         for(unsigned short chunk_y = ((-tileh/2) - r_padding.z + tiley) / 16; chunk_y < ((tileh/2) + r_padding.w + tiley) / 16; ++chunk_y) {
             for(unsigned short chunk_x = ((-tilew/2) - r_padding.x + tilex) / 16; chunk_x < ((tilew/2) + r_padding.y + tilex) / 16; ++chunk_x) {
                 // Rendering chunk by chunk is faster than rendering tile by tile since it means we only have the get the chunk once per chunk instead of once per tile
-                c = get_chunk((UShortVec2){chunk_x, chunk_y});
-                
+                // and the view has the tiles around it for the gas overlays on its edges
+                chunk_view v = view((UShortVec2){chunk_x, chunk_y}, true);
+                c = v.self();
+
+                // Draw the chunk's tiles in one go if they are baked
+                Texture2D * baked = chunk_textures.get(c, tiles::sprites[1].width * 16, [this, c]() { bake_chunk(c); });
+                if(baked) {
+                    x = (chunk_x*16) - tilex;
+                    y = (chunk_y*16) - tiley + 15;
+                    DrawTexturePro(
+                        *baked,
+                        {0, 0, (float)baked->width, -(float)baked->height}, // Render textures are stored upside down
+                        {GetRenderWidth()/2.0f + (x * size) - (modx * size), GetRenderHeight()/2.0f - ((y * size) - (mody * size)), 16 * size + 0.01f, 16 * size + 0.01f},
+                        {0, 0},
+                        0,
+                        WHITE
+                    );
+                }
+
                 // Loop over each tile in the chunk
                 for(unsigned short rel_y = 0; rel_y < 16; ++rel_y) {
                     for(unsigned short rel_x = 0; rel_x < 16; ++rel_x) {
@@ -616,8 +2177,7 @@ class world_map {
                         y = (chunk_y*16) - tiley + rel_y;
                         render_tile(
                             { rel_x, rel_y },   // Position within the chunk
-                            c,                  // The chunk itself
-                            {chunk_x, chunk_y}, // Position of the chunk
+                            v,                  // The chunk and the tiles around it
                             x,                  // Tile position relitive to player
                             y,
                             tilex,              // The position of the player
@@ -625,7 +2185,8 @@ class world_map {
                             size,               // The width/height of a tile
                             scale,              // How zoomed in the game is
                             modx,               // How many pixels to offset the tile by to make the scrolling appear smooth
-                            mody
+                            mody,
+                            baked != nullptr    // Whether the tile itself is already drawn
                         );
                     }
                 }